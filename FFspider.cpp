@@ -1,21 +1,36 @@
 #include <iostream>
 #include <chrono>
 #include <queue>
+#include <deque>
 #include <set>
 #include <unordered_set>
+#include <unordered_map>
+#include <array>
+#include <bitset>
+#include <string_view>
+#include <map>
 #include <vector>
 #include <thread>
 #include <mutex>
 #include <condition_variable>
+#include <functional>
 #include <regex>
 #include <ctime>
 #include <iomanip>
+#include <cstring>
 #include <sstream>
+#include <fstream>
 #include <chrono>
+#include <random>
 
 #include <signal.h>
+#include <setjmp.h>
+#if defined(__SSE2__) || defined(_M_X64)
+#include <emmintrin.h>
+#endif
 #include <gumbo.h>
 #include <cpr/cpr.h>
+#include <curl/curl.h>
 #include <sqlite_orm/sqlite_orm.h>
 #include <boost/program_options.hpp>
 #include <boost/algorithm/string.hpp>
@@ -23,12 +38,17 @@
 #include <boost/algorithm/string/find.hpp>
 #include <boost/functional/hash.hpp>
 #include <boost/filesystem.hpp>
+#include <boost/iostreams/device/mapped_file.hpp>
 #include <boost/locale.hpp>
 #include <boost/regex.hpp>
+#include <boost/asio.hpp>
 
 #include <dlib/image_io.h>
 #include <dlib/image_transforms/interpolation.h>
 #include <dlib/image_transforms.h>
+#include <psapi.h>
+#include <jpeglib.h>
+#include <zlib.h>
 
 using namespace sqlite_orm;
 namespace po = boost::program_options;
@@ -37,21 +57,55 @@ namespace po = boost::program_options;
 const size_t max_image_dims = 1280;
 const size_t min_image_file_size = 200;
 const size_t max_image_file_size = (4 * 1024 * 1024);
-const size_t urls_queue_threshold_max = 50000;
+const size_t frontier_hot_capacity = 50000;
+const size_t frontier_segment_urls = 10000;
+const size_t packed_segment_size = (1024 * 1024 * 1024);
 const size_t urls_queue_threshold_min = 2000;
 const size_t max_threads = 100;
+const size_t max_host_connections = 6;
+const size_t max_host_streams = 100;
+const size_t parse_queue_capacity = 256;
+const size_t transcode_queue_capacity = 256;
 const size_t max_str_length = 1024;
 const size_t max_url_length = 450;
 const size_t max_html_page_size = (2 * 1024 * 1024);
 const size_t auto_flush_time = (5 * 60);
+const size_t persist_time = 10;
+const size_t initial_revisit_interval = (24 * 3600);
+const size_t min_revisit_interval = 3600;
+const size_t max_revisit_interval = (30 * 24 * 3600);
+const size_t near_duplicate_distance = 4;
+const size_t seen_filter_capacity = (1024 * 1024);
+const double seen_filter_error = 0.001;
+const size_t near_duplicate_page_distance = 3;
+const size_t min_simhash_features = 16;
+const size_t recent_page_fingerprints = (512 * 1024);
+const size_t recent_image_contents = (512 * 1024);
+const size_t recent_image_hashes = (512 * 1024);
+const size_t synthetic_image_pool = 500;
+const size_t synthetic_site_threads = 2;
+const size_t warc_segment_size = (1024 * 1024 * 1024);
+const size_t warc_buffer_size = (8 * 1024 * 1024);
+const size_t warc_queue_size = (256 * 1024 * 1024);
+const size_t metrics_request_timeout = 5;
 const std::string unsupported_image_mime = "unsupported";
+const std::string frontier_folder = "frontier";
+const std::string warc_folder = "warc";
 const std::string user_agent = "Mozilla/5.0 (Windows NT 10.0; Win64; x64) AppleWebKit/537.36 (KHTML, like Gecko) Chrome/58.0.3029.110 Safari/537.3";
-std::mutex mtx;
 std::atomic<size_t> total_pages = 0;
 std::atomic<size_t> total_images = 0;
+std::atomic<size_t> total_duplicate_images = 0;
+std::atomic<size_t> total_pruned_pages = 0;
+std::atomic<size_t> visited_pages = 0;
+std::atomic<size_t> visited_images = 0;
+std::atomic<size_t> cached_images = 0;
 std::atomic<bool> verbose = false;
-std::atomic<bool> no_new_urls_auto = false;
 std::atomic<bool> no_new_urls = false;
+bool stream_extractor = false;
+bool use_parse_arena = true;
+bool page_dedup = true;
+bool use_packed_store = false;
+bool replaying = false;
 
 class ElapsedTime {
 public:
@@ -71,6 +125,446 @@ private:
     std::chrono::high_resolution_clock::time_point m_startTime;
 };
 
+// Lock-free log-linear histogram of durations in microseconds (HDR-style): each power of 2 is split into 8 linear
+// sub-buckets, so that a recorded value is known within 12.5% at any scale
+class LatencyHistogram {
+public:
+    static const size_t sub_bits = 3, sub_count = 1 << sub_bits, num_buckets = (64 - sub_bits + 1) * sub_count;
+    struct Snapshot {
+        std::array<uint64_t, num_buckets> buckets = {};
+        uint64_t count = 0, sum = 0;
+        // Values recorded since a previous snapshot
+        Snapshot since(const Snapshot& previous) const {
+            Snapshot delta;
+            for (size_t i = 0; i < num_buckets; ++i) delta.buckets[i] = buckets[i] - previous.buckets[i];
+            delta.count = count - previous.count;
+            delta.sum = sum - previous.sum;
+            return delta;
+        }
+        // Upper bound of the bucket holding the q-quantile
+        uint64_t percentile(const double q) const {
+            const uint64_t target = static_cast<uint64_t>(std::ceil(q * count));
+            uint64_t total = 0;
+            for (size_t i = 0; i < num_buckets; ++i) {
+                total += buckets[i];
+                if (total >= target && total > 0) return bucket_end(i);
+            }
+            return 0;
+        }
+        // Number of values below limit, a power of 2
+        uint64_t count_below(const uint64_t limit) const {
+            uint64_t total = 0;
+            for (size_t i = 0; i < num_buckets && bucket_end(i) <= limit; ++i) total += buckets[i];
+            return total;
+        }
+    };
+    void record(const uint64_t us) {
+        m_buckets[bucket_of(us)].fetch_add(1, std::memory_order_relaxed);
+        m_count.fetch_add(1, std::memory_order_relaxed);
+        m_sum.fetch_add(us, std::memory_order_relaxed);
+    }
+    void record_since(const std::chrono::steady_clock::time_point& start) {
+        record(static_cast<uint64_t>(std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now() - start).count()));
+    }
+    Snapshot snapshot() const {
+        Snapshot snap;
+        for (size_t i = 0; i < num_buckets; ++i) snap.buckets[i] = m_buckets[i].load(std::memory_order_relaxed);
+        snap.count = m_count.load(std::memory_order_relaxed);
+        snap.sum = m_sum.load(std::memory_order_relaxed);
+        return snap;
+    }
+
+private:
+    static size_t bucket_of(const uint64_t value) {
+        if (value < sub_count) return static_cast<size_t>(value);
+        size_t msb = sub_bits;
+        while (msb < 63 && (value >> (msb + 1)) != 0) ++msb;
+        const size_t shift = msb - sub_bits;
+        return (shift + 1) * sub_count + static_cast<size_t>((value >> shift) & (sub_count - 1));
+    }
+    // Exclusive upper bound of a bucket
+    static uint64_t bucket_end(const size_t index) {
+        if (index < sub_count) return index + 1;
+        const size_t shift = index / sub_count - 1;
+        if (shift >= 60) return UINT64_MAX;
+        return ((sub_count + index % sub_count) << shift) + (uint64_t(1) << shift);
+    }
+    std::array<std::atomic<uint64_t>, num_buckets> m_buckets = {};
+    std::atomic<uint64_t> m_count = 0, m_sum = 0;
+};
+// Latency of the stages of the crawl, the fetch times being kept by each fetch engine
+LatencyHistogram dns_latency, connect_latency, parse_latency, extract_latency, image_decode_latency, db_wait_latency;
+
+// Global database lock, timing how long the threads wait for it
+class DbMutex {
+public:
+    void lock() {
+        if (m_mtx.try_lock()) {
+            db_wait_latency.record(0);
+            return;
+        }
+        const auto start = std::chrono::steady_clock::now();
+        m_mtx.lock();
+        db_wait_latency.record_since(start);
+    }
+    bool try_lock() { return m_mtx.try_lock(); }
+    void unlock() { m_mtx.unlock(); }
+
+private:
+    std::mutex m_mtx;
+};
+DbMutex mtx;
+
+// Return the lower case host part of an absolute URL
+std::string get_url_host(const std::string& url) {
+    size_t start = url.find("://");
+    start = (start == std::string::npos) ? 0 : start + 3;
+    const size_t end = url.find_first_of(":/?#", start);
+    return boost::algorithm::to_lower_copy(url.substr(start, end == std::string::npos ? std::string::npos : end - start));
+}
+
+// Pending URLs to crawl, grouped by host. Hosts are spread over shards and each fetch loop owns its shards, so
+// the URLs of a host are always fetched by the same loop and reuse its warm connections. Inside a shard, hosts
+// are served round-robin and never have more than max_per_host requests in flight. An idle loop steals from
+// the shards of the other loops. Beyond hot_capacity URLs, the new ones are appended to segment files on disk,
+// read back sequentially and in order once the frontier runs low. The rows of the spilled URLs are only kept on disk,
+// the refill handler brings them back into memory before their URLs can be popped
+class UrlFrontier {
+public:
+    void init(size_t num_shards, size_t num_owners, size_t max_per_host) {
+        m_shards.clear();
+        for (size_t i = 0; i < num_shards; ++i) m_shards.push_back(std::make_unique<Shard>());
+        m_num_owners = num_owners;
+        m_max_per_host = max_per_host;
+    }
+    void set_spill(const std::string& folder, size_t hot_capacity) {
+        m_spill_folder = folder;
+        m_hot_capacity = hot_capacity;
+        boost::system::error_code ec;
+        boost::filesystem::remove_all(m_spill_folder, ec); // Segments of a previous session, their URLs are reloaded from the database
+        boost::filesystem::create_directories(m_spill_folder, ec);
+    }
+    void set_refill_handler(std::function<void(const std::vector<std::string>&)> handler) {
+        m_refill_handler = std::move(handler);
+    }
+    // Returns true when the URL went to a segment file
+    bool push(const std::string& url) {
+        if (m_hot_capacity != 0 && (m_size >= m_hot_capacity || m_spilled > 0)) { // Keep the order once spilling
+            spill(url);
+            return true;
+        }
+        push_hot(url);
+        return false;
+    }
+    void push_all(const std::vector<std::string>& urls) {
+        for (auto& url : urls) push(url);
+    }
+    bool pop(size_t owner, std::string& url) {
+        if (m_spilled > 0 && m_size < m_hot_capacity / 2) refill();
+        const size_t num_shards = m_shards.size();
+        for (size_t i = owner % m_num_owners; i < num_shards; i += m_num_owners) {
+            if (pop_from(*m_shards[i], url)) return true;
+        }
+        for (size_t i = 0; i < num_shards; ++i) {
+            if (i % m_num_owners != owner % m_num_owners && pop_from(*m_shards[i], url)) return true;
+        }
+        return false;
+    }
+    // The request to this URL is over, its host may be served again
+    void release(const std::string& url) {
+        const std::string host_name = get_url_host(url);
+        Shard& s = get_shard(host_name);
+        std::lock_guard<std::mutex> lck(s.mtx);
+        auto it = s.hosts.find(host_name);
+        if (it == s.hosts.end()) return;
+        Host& host = it->second;
+        if (host.in_flight > 0) host.in_flight--;
+        if (!host.ready && !host.urls.empty()) {
+            s.ready.push_back(host_name);
+            host.ready = true;
+        }
+        else if (host.urls.empty() && host.in_flight == 0) {
+            s.hosts.erase(it);
+        }
+    }
+    size_t size() const { return m_size + m_spilled; }
+    size_t spilled() const { return m_spilled; }
+
+private:
+    void push_hot(const std::string& url) {
+        const std::string host_name = get_url_host(url);
+        Shard& s = get_shard(host_name);
+        std::lock_guard<std::mutex> lck(s.mtx);
+        Host& host = s.hosts[host_name];
+        host.urls.push_back(url);
+        if (!host.ready && host.in_flight < m_max_per_host) {
+            s.ready.push_back(host_name);
+            host.ready = true;
+        }
+        m_size++;
+    }
+    boost::filesystem::path segment_path(size_t index) const {
+        std::stringstream ss;
+        ss << "segment_" << std::setw(8) << std::setfill('0') << index << ".txt";
+        return m_spill_folder / ss.str();
+    }
+    void spill(const std::string& url) {
+        std::lock_guard<std::mutex> lck(m_spill_mtx);
+        if (!m_writer.is_open()) {
+            m_writer.open(segment_path(m_write_index).string(), std::ios::out | std::ios::binary | std::ios::trunc);
+            m_segments.push_back(0);
+        }
+        m_writer << url << '\n';
+        m_segments.back()++;
+        m_spilled++;
+        if (m_segments.back() == frontier_segment_urls) {
+            m_writer.close();
+            m_write_index++;
+        }
+    }
+    // Move the oldest segment back into memory. Only one fetch loop does it, the others keep popping
+    void refill() {
+        std::unique_lock<std::mutex> lck(m_spill_mtx, std::try_to_lock);
+        if (!lck.owns_lock() || m_segments.empty()) return;
+        if (m_segments.size() == 1 && m_writer.is_open()) { // Only the segment being written is left
+            m_writer.close();
+            m_write_index++;
+        }
+        const boost::filesystem::path path = segment_path(m_read_index++);
+        std::ifstream reader(path.string(), std::ios::in | std::ios::binary);
+        std::vector<std::string> urls;
+        std::string url;
+        while (std::getline(reader, url)) {
+            if (!url.empty()) urls.push_back(std::move(url));
+        }
+        reader.close();
+        if (m_refill_handler) m_refill_handler(urls);
+        for (auto& u : urls) push_hot(u);
+        m_spilled -= m_segments.front();
+        m_segments.pop_front();
+        boost::system::error_code ec;
+        boost::filesystem::remove(path, ec);
+    }
+    struct Host {
+        std::deque<std::string> urls;
+        size_t in_flight = 0;
+        bool ready = false;
+    };
+    struct Shard {
+        std::mutex mtx;
+        std::unordered_map<std::string, Host> hosts;
+        std::deque<std::string> ready; // Hosts with pending URLs and below their in-flight limit
+    };
+    Shard& get_shard(const std::string& host_name) {
+        return *m_shards[std::hash<std::string>{}(host_name) % m_shards.size()];
+    }
+    bool pop_from(Shard& s, std::string& url) {
+        std::lock_guard<std::mutex> lck(s.mtx);
+        if (s.ready.empty()) return false;
+        const std::string host_name = std::move(s.ready.front());
+        s.ready.pop_front();
+        Host& host = s.hosts[host_name];
+        host.ready = false;
+        url = std::move(host.urls.front());
+        host.urls.pop_front();
+        host.in_flight++;
+        if (!host.urls.empty() && host.in_flight < m_max_per_host) {
+            s.ready.push_back(host_name);
+            host.ready = true;
+        }
+        m_size--;
+        return true;
+    }
+
+    std::vector<std::unique_ptr<Shard>> m_shards;
+    size_t m_num_owners = 1, m_max_per_host = 1;
+    std::atomic<size_t> m_size = 0;
+    // Spilled URLs
+    std::mutex m_spill_mtx;
+    boost::filesystem::path m_spill_folder;
+    size_t m_hot_capacity = 0, m_read_index = 0, m_write_index = 0;
+    std::ofstream m_writer;
+    std::deque<size_t> m_segments; // Number of URLs of each segment not read yet
+    std::atomic<size_t> m_spilled = 0;
+    std::function<void(const std::vector<std::string>&)> m_refill_handler;
+};
+UrlFrontier frontier;
+
+// 64-bit FNV-1a fingerprint of an URL
+uint64_t url_fingerprint(const std::string& url) {
+    uint64_t h = 0xcbf29ce484222325ULL;
+    for (const unsigned char ch : url) {
+        h ^= ch;
+        h *= 0x100000001b3ULL;
+    }
+    return h;
+}
+// Hash of a downloaded content, to tell whether it changed since the previous visit
+std::string get_content_hash(const std::string& content) {
+    std::stringstream ss;
+    ss << std::hex << std::setw(16) << std::setfill('0') << url_fingerprint(content);
+    return ss.str();
+}
+
+// SHA-256 (FIPS 180-4) of the image contents, which are stored under their digest
+using Sha256Digest = std::array<uint8_t, 32>;
+Sha256Digest sha256(const std::string& data) {
+    static const uint32_t k[64] = {
+        0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5, 0x3956c25b, 0x59f111f1, 0x923f82a4, 0xab1c5ed5, 0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3, 0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174,
+        0xe49b69c1, 0xefbe4786, 0x0fc19dc6, 0x240ca1cc, 0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da, 0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7, 0xc6e00bf3, 0xd5a79147, 0x06ca6351, 0x14292967,
+        0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13, 0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85, 0xa2bfe8a1, 0xa81a664b, 0xc24b8b70, 0xc76c51a3, 0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+        0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5, 0x391c0cb3, 0x4ed8aa4a, 0x5b9cca4f, 0x682e6ff3, 0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208, 0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2 };
+    uint32_t h[8] = { 0x6a09e667, 0xbb67ae85, 0x3c6ef372, 0xa54ff53a, 0x510e527f, 0x9b05688c, 0x1f83d9ab, 0x5be0cd19 };
+    auto rotr = [](const uint32_t x, const int n) { return (x >> n) | (x << (32 - n)); };
+    auto compress = [&](const unsigned char* block) {
+        uint32_t w[64];
+        for (int i = 0; i < 16; ++i) w[i] = (uint32_t(block[4 * i]) << 24) | (uint32_t(block[4 * i + 1]) << 16) | (uint32_t(block[4 * i + 2]) << 8) | uint32_t(block[4 * i + 3]);
+        for (int i = 16; i < 64; ++i) {
+            const uint32_t s0 = rotr(w[i - 15], 7) ^ rotr(w[i - 15], 18) ^ (w[i - 15] >> 3), s1 = rotr(w[i - 2], 17) ^ rotr(w[i - 2], 19) ^ (w[i - 2] >> 10);
+            w[i] = w[i - 16] + s0 + w[i - 7] + s1;
+        }
+        uint32_t a = h[0], b = h[1], c = h[2], d = h[3], e = h[4], f = h[5], g = h[6], hh = h[7];
+        for (int i = 0; i < 64; ++i) {
+            const uint32_t t1 = hh + (rotr(e, 6) ^ rotr(e, 11) ^ rotr(e, 25)) + ((e & f) ^ (~e & g)) + k[i] + w[i];
+            const uint32_t t2 = (rotr(a, 2) ^ rotr(a, 13) ^ rotr(a, 22)) + ((a & b) ^ (a & c) ^ (b & c));
+            hh = g; g = f; f = e; e = d + t1; d = c; c = b; b = a; a = t1 + t2;
+        }
+        h[0] += a; h[1] += b; h[2] += c; h[3] += d; h[4] += e; h[5] += f; h[6] += g; h[7] += hh;
+    };
+    const unsigned char* p = reinterpret_cast<const unsigned char*>(data.data());
+    const size_t size = data.size(), full = size / 64 * 64;
+    for (size_t i = 0; i < full; i += 64) compress(p + i);
+    // Padding: 0x80, zeros, then the length in bits
+    unsigned char tail[128] = {};
+    const size_t rest = size - full, tail_size = rest < 56 ? 64 : 128;
+    std::memcpy(tail, p + full, rest);
+    tail[rest] = 0x80;
+    const uint64_t bits = static_cast<uint64_t>(size) * 8;
+    for (int i = 0; i < 8; ++i) tail[tail_size - 1 - i] = static_cast<unsigned char>(bits >> (8 * i));
+    for (size_t i = 0; i < tail_size; i += 64) compress(tail + i);
+    Sha256Digest digest;
+    for (int i = 0; i < 32; ++i) digest[i] = static_cast<uint8_t>(h[i / 4] >> (24 - 8 * (i % 4)));
+    return digest;
+}
+std::string to_hex(const uint8_t* data, const size_t size) {
+    static const char digits[] = "0123456789abcdef";
+    std::string hex(size * 2, '0');
+    for (size_t i = 0; i < size; ++i) {
+        hex[2 * i] = digits[data[i] >> 4];
+        hex[2 * i + 1] = digits[data[i] & 15];
+    }
+    return hex;
+}
+bool from_hex(const std::string& hex, uint8_t* data, const size_t size) {
+    if (hex.size() != size * 2) return false;
+    for (size_t i = 0; i < hex.size(); ++i) {
+        const char ch = hex[i];
+        const int value = (ch >= '0' && ch <= '9') ? ch - '0' : ((ch >= 'a' && ch <= 'f') ? ch - 'a' + 10 : -1);
+        if (value < 0) return false;
+        data[i / 2] = static_cast<uint8_t>((i % 2) == 0 ? value << 4 : data[i / 2] | value);
+    }
+    return true;
+}
+
+// Fingerprints of the URLs dropped after a failure, lock-striped to test for them without SQL
+class SeenSet {
+public:
+    // Returns true if the fingerprint was not already present
+    bool insert(uint64_t fp) {
+        Stripe& s = m_stripes[fp % num_stripes];
+        std::lock_guard<std::mutex> lck(s.mtx);
+        return s.fps.insert(fp).second;
+    }
+    bool contains(uint64_t fp) {
+        Stripe& s = m_stripes[fp % num_stripes];
+        std::lock_guard<std::mutex> lck(s.mtx);
+        return s.fps.count(fp) != 0;
+    }
+    size_t size() {
+        size_t total = 0;
+        for (auto& s : m_stripes) {
+            std::lock_guard<std::mutex> lck(s.mtx);
+            total += s.fps.size();
+        }
+        return total;
+    }
+
+private:
+    static const size_t num_stripes = 64;
+    struct Stripe {
+        std::mutex mtx;
+        std::unordered_set<uint64_t> fps;
+    };
+    Stripe m_stripes[num_stripes];
+};
+SeenSet dropped_urls, dropped_images;
+
+// Fingerprints of all the known URLs, in a scalable Bloom filter: when the last filter is full, another one twice as
+// large and with half its error rate is added, so that it takes about 2 bytes per URL at any crawl size. A hit may be
+// a false positive and has to be confirmed against the databases, a miss is always a new URL
+class SeenFilter {
+public:
+    SeenFilter(size_t initial_capacity, double error_rate) {
+        m_filters[0] = std::make_unique<Filter>(initial_capacity, error_rate);
+    }
+    // Returns true if the fingerprint was surely not present, it is added then
+    bool insert(uint64_t fp) {
+        std::lock_guard<std::mutex> lck(m_stripes[fp % num_stripes]); // The same fingerprint is never tested twice at once
+        const size_t num_filters = m_num_filters.load(std::memory_order_acquire);
+        for (size_t i = 0; i < num_filters; ++i) {
+            if (m_filters[i]->contains(fp)) return false;
+        }
+        Filter& last = *m_filters[num_filters - 1];
+        last.add(fp);
+        if (++last.count == last.capacity && num_filters < max_filters) {
+            std::lock_guard<std::mutex> grow_lck(m_grow_mtx);
+            m_filters[num_filters] = std::make_unique<Filter>(last.capacity * 2, last.error_rate / 2);
+            m_num_filters.store(num_filters + 1, std::memory_order_release);
+        }
+        return true;
+    }
+
+private:
+    struct Filter {
+        Filter(size_t capacity_, double error_rate_) : capacity(capacity_), error_rate(error_rate_) {
+            const double ln2 = std::log(2.0);
+            num_bits = std::max<size_t>(64, static_cast<size_t>(-static_cast<double>(capacity) * std::log(error_rate) / (ln2 * ln2)));
+            num_hashes = std::max<size_t>(1, static_cast<size_t>(std::round(static_cast<double>(num_bits) / capacity * ln2)));
+            words = std::make_unique<std::atomic<uint64_t>[]>((num_bits + 63) / 64);
+        }
+        // Double hashing of the fingerprint
+        bool contains(uint64_t fp) const {
+            const uint64_t step = mix(fp) | 1;
+            for (size_t i = 0; i < num_hashes; ++i, fp += step) {
+                const size_t bit = fp % num_bits;
+                if ((words[bit / 64].load(std::memory_order_relaxed) & (1ULL << (bit % 64))) == 0) return false;
+            }
+            return true;
+        }
+        void add(uint64_t fp) {
+            const uint64_t step = mix(fp) | 1;
+            for (size_t i = 0; i < num_hashes; ++i, fp += step) {
+                const size_t bit = fp % num_bits;
+                words[bit / 64].fetch_or(1ULL << (bit % 64), std::memory_order_relaxed);
+            }
+        }
+        static uint64_t mix(uint64_t h) {
+            h = (h ^ (h >> 30)) * 0xbf58476d1ce4e5b9ULL;
+            h = (h ^ (h >> 27)) * 0x94d049bb133111ebULL;
+            return h ^ (h >> 31);
+        }
+        size_t capacity, num_bits = 0, num_hashes = 0;
+        double error_rate;
+        std::atomic<size_t> count = 0;
+        std::unique_ptr<std::atomic<uint64_t>[]> words;
+    };
+    static const size_t num_stripes = 64, max_filters = 32;
+    std::mutex m_stripes[num_stripes], m_grow_mtx;
+    std::unique_ptr<Filter> m_filters[max_filters];
+    std::atomic<size_t> m_num_filters = 1;
+};
+SeenFilter seen_urls(seen_filter_capacity, seen_filter_error), seen_images(seen_filter_capacity, seen_filter_error);
+
 // To properly stop the program
 std::atomic<bool> stop_requested(false);
 BOOL CtrlHandler(DWORD fdwCtrlType) {
@@ -85,76 +579,3523 @@ BOOL CtrlHandler(DWORD fdwCtrlType) {
     }
 }
 
-// Url metadata struct
-struct UrlData {    
-    std::string url;
-    std::unique_ptr <std::string> last_crawled;
-    std::string last_seen;
-    std::size_t status_code;
+// Bounded blocking queue between two stages of the crawling pipeline
+template <typename T>
+class BoundedQueue {
+public:
+    explicit BoundedQueue(size_t capacity) : m_capacity(capacity) {}
+    // Blocks while the queue is full, returns false once the queue is closed
+    bool push(T&& item) {
+        std::unique_lock<std::mutex> lck(m_mtx);
+        m_not_full.wait(lck, [this] { return m_items.size() < m_capacity || m_closed; });
+        if (m_closed) return false;
+        m_items.push_back(std::move(item));
+        m_not_empty.notify_one();
+        return true;
+    }
+    // Returns false right away when the queue is empty
+    bool try_pop(T& item) {
+        std::lock_guard<std::mutex> lck(m_mtx);
+        if (m_items.empty() || m_closed) return false;
+        item = std::move(m_items.front());
+        m_items.pop_front();
+        m_not_full.notify_one();
+        return true;
+    }
+    // Blocks while the queue is empty, returns false once the queue is closed (pending items are dropped)
+    bool pop(T& item) {
+        std::unique_lock<std::mutex> lck(m_mtx);
+        m_not_empty.wait(lck, [this] { return !m_items.empty() || m_closed; });
+        if (m_closed) return false;
+        item = std::move(m_items.front());
+        m_items.pop_front();
+        m_not_full.notify_one();
+        return true;
+    }
+    void close() {
+        std::lock_guard<std::mutex> lck(m_mtx);
+        m_closed = true;
+        m_not_empty.notify_all();
+        m_not_full.notify_all();
+    }
+    void set_capacity(size_t capacity) {
+        std::lock_guard<std::mutex> lck(m_mtx);
+        m_capacity = capacity;
+        m_not_full.notify_all();
+    }
+    size_t size() {
+        std::lock_guard<std::mutex> lck(m_mtx);
+        return m_items.size();
+    }
+    bool full() {
+        std::lock_guard<std::mutex> lck(m_mtx);
+        return m_items.size() >= m_capacity;
+    }
+
+private:
+    size_t m_capacity;
+    bool m_closed = false;
+    std::mutex m_mtx;
+    std::condition_variable m_not_empty, m_not_full;
+    std::deque<T> m_items;
+};
+
+// Event-driven HTTP fetcher built on the curl multi interface: each loop thread drives its own
+// multi handle, keeps up to its share of the in-flight requests running and hands every completed
+// transfer over to a callback
+class FetchEngine {
+public:
+    struct Transfer {
+        CURL* easy = nullptr;
+        std::string url;
+        std::string body;
+        bool truncated = false;
+        bool rejected = false;
+        long status_code = 0;
+        CURLcode result = CURLE_OK;
+        std::string etag, last_modified; // Validators sent back by the server
+        curl_slist* request_headers = nullptr;
+    };
+    // Returns false when there is nothing to fetch for now
+    using NextFunction = std::function<bool(size_t loop_id, std::string& url)>;
+    using DoneFunction = std::function<void(size_t loop_id, Transfer& transfer)>;
+    // Called each time new data is received, returns false to abort the transfer
+    using CheckFunction = std::function<bool(Transfer& transfer)>;
+    // Returns true with the validators of a previous visit to send a conditional request
+    using ValidatorsFunction = std::function<bool(const std::string& url, std::string& etag, std::string& last_modified)>;
+
+    FetchEngine(const std::string& accept, long connect_timeout_ms, long timeout_ms, size_t max_body_size) :
+        m_accept("Accept: " + accept), m_connect_timeout_ms(connect_timeout_ms), m_timeout_ms(timeout_ms), m_max_body_size(max_body_size) {}
+    ~FetchEngine() { if (m_headers != nullptr) curl_slist_free_all(m_headers); }
+
+    void set_check(CheckFunction check) { m_check = check; }
+    void set_validators(ValidatorsFunction validators) { m_validators = validators; }
+    void start(size_t num_loops, size_t max_in_flight, NextFunction next, DoneFunction done) {
+        m_next = next;
+        m_done = done;
+        m_headers = curl_slist_append(m_headers, m_accept.c_str());
+        const size_t loop_in_flight = std::max<size_t>(1, max_in_flight / num_loops);
+        for (size_t i = 0; i < num_loops; ++i) m_loops.emplace_back(&FetchEngine::loop, this, i, loop_in_flight);
+    }
+    void join() {
+        for (auto& t : m_loops) t.join();
+        m_loops.clear();
+    }
+    size_t in_flight() const { return m_in_flight; }
+    size_t new_connections() const { return m_new_connections; }
+    size_t reused_connections() const { return m_reused_connections; }
+    // Average DNS + TCP + TLS time of the new connections, in milliseconds
+    double handshake_ms() const { return m_new_connections == 0 ? 0.0 : m_handshake_us / 1000.0 / m_new_connections; }
+    const LatencyHistogram& fetch_latency() const { return m_fetch_latency; }
+    // Bytes received (headers and encoded bodies) and bodies once decoded
+    size_t wire_bytes() const { return m_wire_bytes; }
+    size_t decoded_bytes() const { return m_decoded_bytes; }
+    size_t http2_transfers() const { return m_http2_transfers; }
+
+private:
+    // DNS cache and TLS sessions shared by all the easy handles of all the engines
+    static void lock_shared(CURL* handle, curl_lock_data data, curl_lock_access access, void* userptr) {
+        static_cast<std::mutex*>(userptr)[data].lock();
+    }
+    static void unlock_shared(CURL* handle, curl_lock_data data, void* userptr) {
+        static_cast<std::mutex*>(userptr)[data].unlock();
+    }
+    static CURLSH* get_shared_cache() {
+        static std::mutex locks[CURL_LOCK_DATA_LAST];
+        static CURLSH* share = []() {
+            CURLSH* sh = curl_share_init();
+            curl_share_setopt(sh, CURLSHOPT_LOCKFUNC, &FetchEngine::lock_shared);
+            curl_share_setopt(sh, CURLSHOPT_UNLOCKFUNC, &FetchEngine::unlock_shared);
+            curl_share_setopt(sh, CURLSHOPT_USERDATA, locks);
+            curl_share_setopt(sh, CURLSHOPT_SHARE, CURL_LOCK_DATA_DNS);
+            curl_share_setopt(sh, CURLSHOPT_SHARE, CURL_LOCK_DATA_SSL_SESSION);
+            return sh;
+        }();
+        return share;
+    }
+    // Receives the decoded body, the size cap protects from the bodies that decompress to much more than they weigh
+    static size_t write_body(char* ptr, size_t size, size_t nmemb, void* userdata) {
+        auto* t = static_cast<std::pair<FetchEngine*, Transfer*>*>(userdata);
+        const size_t len = size * nmemb, max_size = t->first->m_max_body_size;
+        std::string& body = t->second->body;
+        if (body.size() + len > max_size) {
+            body.append(ptr, max_size - body.size());
+            t->second->truncated = true;
+            return 0; // Abort the transfer, we already have all we need
+        }
+        body.append(ptr, len);
+        if (t->first->m_check && !t->first->m_check(*t->second)) {
+            t->second->rejected = true;
+            return 0;
+        }
+        return len;
+    }
+    static size_t read_header(char* ptr, size_t size, size_t nmemb, void* userdata) {
+        Transfer* t = static_cast<std::pair<FetchEngine*, Transfer*>*>(userdata)->second;
+        const size_t len = size * nmemb;
+        const std::string_view line(ptr, len);
+        const size_t colon = line.find(':');
+        if (line.compare(0, 5, "HTTP/") == 0) { // Headers of a new response, after a redirection
+            t->etag.clear();
+            t->last_modified.clear();
+        }
+        else if (colon != std::string_view::npos) {
+            const std::string name = boost::algorithm::to_lower_copy(std::string(line.substr(0, colon)));
+            std::string* value = name == "etag" ? &t->etag : (name == "last-modified" ? &t->last_modified : nullptr);
+            if (value != nullptr) {
+                value->assign(line.substr(colon + 1));
+                boost::algorithm::trim(*value);
+            }
+        }
+        return len;
+    }
+    void setup(CURL* easy, std::pair<FetchEngine*, Transfer*>* ctx) {
+        curl_easy_setopt(easy, CURLOPT_USERAGENT, user_agent.c_str());
+        curl_easy_setopt(easy, CURLOPT_HTTPHEADER, m_headers);
+        curl_easy_setopt(easy, CURLOPT_CONNECTTIMEOUT_MS, m_connect_timeout_ms);
+        curl_easy_setopt(easy, CURLOPT_TIMEOUT_MS, m_timeout_ms);
+        curl_easy_setopt(easy, CURLOPT_FOLLOWLOCATION, 1L);
+        curl_easy_setopt(easy, CURLOPT_MAXREDIRS, 10L);
+        curl_easy_setopt(easy, CURLOPT_NOSIGNAL, 1L);
+        curl_easy_setopt(easy, CURLOPT_TCP_KEEPALIVE, 1L);
+        curl_easy_setopt(easy, CURLOPT_DNS_CACHE_TIMEOUT, 600L);
+        curl_easy_setopt(easy, CURLOPT_SHARE, get_shared_cache());
+        // All the encodings curl was built with (gzip, deflate, brotli, zstd), decoded while the body streams in
+        curl_easy_setopt(easy, CURLOPT_ACCEPT_ENCODING, "");
+        // HTTP/2 over TLS when the server supports it: the new transfers to a host wait for its connection to multiplex them
+        curl_easy_setopt(easy, CURLOPT_HTTP_VERSION, static_cast<long>(CURL_HTTP_VERSION_2TLS));
+        curl_easy_setopt(easy, CURLOPT_PIPEWAIT, 1L);
+        curl_easy_setopt(easy, CURLOPT_WRITEFUNCTION, &FetchEngine::write_body);
+        curl_easy_setopt(easy, CURLOPT_WRITEDATA, ctx);
+        curl_easy_setopt(easy, CURLOPT_HEADERFUNCTION, &FetchEngine::read_header);
+        curl_easy_setopt(easy, CURLOPT_HEADERDATA, ctx);
+        curl_easy_setopt(easy, CURLOPT_PRIVATE, ctx);
+    }
+    void loop(size_t id, size_t max_in_flight) {
+        CURLM* multi = curl_multi_init();
+        curl_multi_setopt(multi, CURLMOPT_MAX_HOST_CONNECTIONS, static_cast<long>(max_host_connections));
+        curl_multi_setopt(multi, CURLMOPT_MAXCONNECTS, static_cast<long>(max_in_flight));
+        curl_multi_setopt(multi, CURLMOPT_PIPELINING, CURLPIPE_MULTIPLEX);
+        curl_multi_setopt(multi, CURLMOPT_MAX_CONCURRENT_STREAMS, static_cast<long>(max_host_streams));
+        std::vector<std::unique_ptr<Transfer>> transfers;
+        std::vector<std::unique_ptr<std::pair<FetchEngine*, Transfer*>>> contexts;
+        std::vector<Transfer*> idle;
+        size_t running = 0;
+        std::string url;
+
+        while (!stop_requested) {
+            // Start new transfers while we are below the in-flight limit
+            while (running < max_in_flight && m_next(id, url)) {
+                Transfer* t = nullptr;
+                if (idle.empty()) {
+                    transfers.push_back(std::make_unique<Transfer>());
+                    t = transfers.back().get();
+                    contexts.push_back(std::make_unique<std::pair<FetchEngine*, Transfer*>>(this, t));
+                    t->easy = curl_easy_init();
+                    setup(t->easy, contexts.back().get());
+                }
+                else {
+                    t = idle.back();
+                    idle.pop_back();
+                }
+                t->url = std::move(url);
+                t->body.clear();
+                t->truncated = false;
+                t->rejected = false;
+                t->status_code = 0;
+                t->etag.clear();
+                t->last_modified.clear();
+                // Conditional request when the page was already visited
+                std::string etag, last_modified;
+                if (m_validators && m_validators(t->url, etag, last_modified)) {
+                    t->request_headers = curl_slist_append(nullptr, m_accept.c_str());
+                    if (!etag.empty()) t->request_headers = curl_slist_append(t->request_headers, ("If-None-Match: " + etag).c_str());
+                    if (!last_modified.empty()) t->request_headers = curl_slist_append(t->request_headers, ("If-Modified-Since: " + last_modified).c_str());
+                }
+                curl_easy_setopt(t->easy, CURLOPT_HTTPHEADER, t->request_headers != nullptr ? t->request_headers : m_headers);
+                curl_easy_setopt(t->easy, CURLOPT_URL, t->url.c_str());
+                curl_multi_add_handle(multi, t->easy);
+                running++;
+                m_in_flight++;
+            }
+            if (running == 0) {
+                std::this_thread::sleep_for(std::chrono::milliseconds(200));
+                continue;
+            }
+
+            int still_running = 0, msgs_left = 0;
+            curl_multi_perform(multi, &still_running);
+            CURLMsg* msg = nullptr;
+            while ((msg = curl_multi_info_read(multi, &msgs_left)) != nullptr) {
+                if (msg->msg != CURLMSG_DONE) continue;
+                std::pair<FetchEngine*, Transfer*>* ctx = nullptr;
+                curl_easy_getinfo(msg->easy_handle, CURLINFO_PRIVATE, &ctx);
+                Transfer* t = ctx->second;
+                t->result = msg->data.result;
+                curl_easy_getinfo(t->easy, CURLINFO_RESPONSE_CODE, &t->status_code);
+                long num_connects = 0;
+                curl_off_t dns_us = 0, handshake_us = 0, tls_us = 0, total_us = 0;
+                curl_easy_getinfo(t->easy, CURLINFO_NUM_CONNECTS, &num_connects);
+                curl_easy_getinfo(t->easy, CURLINFO_NAMELOOKUP_TIME_T, &dns_us);
+                curl_easy_getinfo(t->easy, CURLINFO_CONNECT_TIME_T, &handshake_us);
+                curl_easy_getinfo(t->easy, CURLINFO_APPCONNECT_TIME_T, &tls_us);
+                curl_easy_getinfo(t->easy, CURLINFO_TOTAL_TIME_T, &total_us);
+                if (num_connects > 0) {
+                    m_new_connections++;
+                    m_handshake_us += static_cast<size_t>(std::max(handshake_us, tls_us));
+                    dns_latency.record(static_cast<uint64_t>(dns_us));
+                    connect_latency.record(static_cast<uint64_t>(std::max<curl_off_t>(0, std::max(handshake_us, tls_us) - dns_us)));
+                }
+                else if (t->result == CURLE_OK) {
+                    m_reused_connections++;
+                }
+                if (t->result == CURLE_OK) m_fetch_latency.record(static_cast<uint64_t>(total_us));
+                curl_off_t body_size = 0;
+                long header_size = 0, http_version = 0;
+                curl_easy_getinfo(t->easy, CURLINFO_SIZE_DOWNLOAD_T, &body_size); // Before decoding
+                curl_easy_getinfo(t->easy, CURLINFO_HEADER_SIZE, &header_size);
+                curl_easy_getinfo(t->easy, CURLINFO_HTTP_VERSION, &http_version);
+                m_wire_bytes += static_cast<size_t>(body_size) + static_cast<size_t>(header_size);
+                m_decoded_bytes += t->body.size();
+                if (http_version == CURL_HTTP_VERSION_2_0) m_http2_transfers++;
+                curl_multi_remove_handle(multi, t->easy);
+                if (t->request_headers != nullptr) {
+                    curl_slist_free_all(t->request_headers);
+                    t->request_headers = nullptr;
+                }
+                running--;
+                m_in_flight--;
+                m_done(id, *t);
+                idle.push_back(t);
+            }
+            curl_multi_poll(multi, nullptr, 0, 100, nullptr);
+        }
+
+        for (auto& t : transfers) {
+            curl_multi_remove_handle(multi, t->easy);
+            curl_easy_cleanup(t->easy);
+            if (t->request_headers != nullptr) curl_slist_free_all(t->request_headers);
+        }
+        m_in_flight -= running;
+        curl_multi_cleanup(multi);
+    }
+
+    std::string m_accept;
+    long m_connect_timeout_ms, m_timeout_ms;
+    size_t m_max_body_size;
+    curl_slist* m_headers = nullptr;
+    NextFunction m_next;
+    DoneFunction m_done;
+    CheckFunction m_check;
+    ValidatorsFunction m_validators;
+    std::vector<std::thread> m_loops;
+    std::atomic<size_t> m_in_flight = 0;
+    std::atomic<size_t> m_new_connections = 0, m_reused_connections = 0, m_handshake_us = 0;
+    std::atomic<size_t> m_wire_bytes = 0, m_decoded_bytes = 0, m_http2_transfers = 0;
+    LatencyHistogram m_fetch_latency;
+};
+
+// Url metadata struct
+struct UrlData {    
+    std::string url;
+    std::unique_ptr <std::string> last_crawled;
+    std::string last_seen;
+    std::size_t status_code;
+    std::string etag;
+    std::string last_modified;
+    std::string content_hash;
+    std::size_t revisit_interval = 0;
+    std::string next_crawl;
+};
+
+// Image metadata struct
+struct ImageData {
+    std::string url;
+    std::unique_ptr<std::string> alt;
+    std::string source_page;
+    std::unique_ptr<std::string> surrounding_text;
+    std::size_t file_size;
+    std::size_t width;
+    std::size_t height;
+    std::unique_ptr<std::string> mime;
+    std::string last_seen;
+    std::string etag;
+    std::string last_modified;
+    std::string content_hash; // SHA-256 of the stored content the image points at
+    std::string phash;
+};
+
+// Location of an image content in the packed store
+struct ImageBlob {
+    std::string key; // SHA-256 of the content, as in ImageData::content_hash
+    std::size_t segment;
+    std::size_t offset;
+    std::size_t size;
+};
+
+// Validators and schedule of a crawled page
+struct PageValidators {
+    std::string etag;
+    std::string last_modified;
+    std::string content_hash;
+    std::size_t revisit_interval = 0;
+    std::string next_crawl;
+    bool revisit = false; // Not stored, true when the page had already been crawled
+};
+
+// Database connection and table mapping. The disk-based structure is opened by the main connection and by the read connection of each thread
+auto make_queues_storage(const std::string& path) {
+    return make_storage(path,
+        make_index("images_content_hash", &ImageData::content_hash),
+        sqlite_orm::make_table("images",
+            make_column("url", &ImageData::url, unique()),
+            make_column("alt", &ImageData::alt),
+            make_column("source", &ImageData::source_page),
+            make_column("surrounding", &ImageData::surrounding_text),
+            make_column("file_size", &ImageData::file_size),
+            make_column("width", &ImageData::width),
+            make_column("height", &ImageData::height),
+            make_column("mime", &ImageData::mime),
+            make_column("last_seen", &ImageData::last_seen),
+            make_column("etag", &ImageData::etag, default_value("")),
+            make_column("last_modified", &ImageData::last_modified, default_value("")),
+            make_column("content_hash", &ImageData::content_hash, default_value("")),
+            make_column("phash", &ImageData::phash, default_value(""))),
+        sqlite_orm::make_table("blobs",
+            make_column("key", &ImageBlob::key, unique()),
+            make_column("segment", &ImageBlob::segment),
+            make_column("offset", &ImageBlob::offset),
+            make_column("size", &ImageBlob::size)),
+        sqlite_orm::make_table("urls",
+            make_column("url", &UrlData::url, unique()),
+            make_column("last_crawled", &UrlData::last_crawled),
+            make_column("last_seen", &UrlData::last_seen),
+            make_column("status_code", &UrlData::status_code),
+            make_column("etag", &UrlData::etag, default_value("")),
+            make_column("last_modified", &UrlData::last_modified, default_value("")),
+            make_column("content_hash", &UrlData::content_hash, default_value("")),
+            make_column("revisit_interval", &UrlData::revisit_interval, default_value(0)),
+            make_column("next_crawl", &UrlData::next_crawl, default_value("")))
+    );
+}
+auto storage = make_queues_storage("queues.db");
+// Read connection of the calling thread to the disk-based database: with WAL, its lookups only see the committed rows
+// and never run inside a transaction of the persister
+decltype(storage)& get_lookup_storage() {
+    thread_local std::unique_ptr<decltype(storage)> lookup;
+    if (!lookup) {
+        lookup = std::make_unique<decltype(storage)>(make_queues_storage("queues.db"));
+        lookup->open_forever();
+        lookup->pragma.busy_timeout(5000);
+    }
+    return *lookup;
+}
+// In memory structure
+auto memory_storage = make_storage(":memory:",
+    make_table("images",
+        make_column("url", &ImageData::url, unique()),
+        make_column("alt", &ImageData::alt),
+        make_column("source", &ImageData::source_page),
+        make_column("surrounding", &ImageData::surrounding_text),
+        make_column("file_size", &ImageData::file_size),
+        make_column("width", &ImageData::width),
+        make_column("height", &ImageData::height),
+        make_column("mime", &ImageData::mime),
+        make_column("last_seen", &ImageData::last_seen),
+        make_column("etag", &ImageData::etag, default_value("")),
+        make_column("last_modified", &ImageData::last_modified, default_value("")),
+        make_column("content_hash", &ImageData::content_hash, default_value("")),
+        make_column("phash", &ImageData::phash, default_value(""))),
+    make_table("urls",
+        make_column("url", &UrlData::url, unique()),
+        make_column("last_crawled", &UrlData::last_crawled),
+        make_column("last_seen", &UrlData::last_seen),
+        make_column("status_code", &UrlData::status_code),
+        make_column("etag", &UrlData::etag, default_value("")),
+        make_column("last_modified", &UrlData::last_modified, default_value("")),
+        make_column("content_hash", &UrlData::content_hash, default_value("")),
+        make_column("revisit_interval", &UrlData::revisit_interval, default_value(0)),
+        make_column("next_crawl", &UrlData::next_crawl, default_value("")))
+);
+
+std::string format_time(const std::time_t time) {
+    struct tm tm;
+    localtime_s(&tm, &time);
+
+    std::stringstream stream;
+    stream << std::put_time(&tm, "%Y-%m-%d %H:%M:%S");
+    return stream.str();
+}
+std::string get_current_time() {
+    return format_time(std::chrono::system_clock::to_time_t(std::chrono::system_clock::now()));
+}
+std::time_t parse_time(const std::string& text) {
+    struct tm tm = {};
+    std::istringstream stream(text);
+    stream >> std::get_time(&tm, "%Y-%m-%d %H:%M:%S");
+    if (stream.fail()) return 0;
+    tm.tm_isdst = -1;
+    return std::mktime(&tm);
+}
+// UTC date of the WARC records
+std::string get_warc_date() {
+    const std::time_t now = std::time(nullptr);
+    struct tm tm;
+    gmtime_s(&tm, &now);
+    std::stringstream stream;
+    stream << std::put_time(&tm, "%Y-%m-%dT%H:%M:%SZ");
+    return stream.str();
+}
+
+// Rows of the in-memory database changed or removed since they were last written into queues.db.
+// They are appended to the disk-based database by batches, without holding the global lock during disk writes
+class Persister {
+public:
+    void mark_url(const std::string& url) {
+        std::lock_guard<std::mutex> lck(m_mtx);
+        m_urls.insert(url);
+    }
+    void mark_urls(const std::vector<std::string>& urls) {
+        std::lock_guard<std::mutex> lck(m_mtx);
+        m_urls.insert(urls.begin(), urls.end());
+    }
+    void mark_image(const std::string& url) {
+        std::lock_guard<std::mutex> lck(m_mtx);
+        m_images.insert(url);
+    }
+    // URLs moved to a frontier segment, their rows leave the memory once written
+    void spill_urls(const std::vector<std::string>& urls) {
+        std::lock_guard<std::mutex> lck(m_mtx);
+        m_spilled_urls.insert(urls.begin(), urls.end());
+    }
+    // URLs read back from a frontier segment, their rows must stay in memory: a flush under way skips them as changed rows
+    void unspill_urls(const std::vector<std::string>& urls) {
+        std::lock_guard<std::mutex> lck(m_mtx);
+        for (auto& url : urls) m_spilled_urls.erase(url);
+        m_urls.insert(urls.begin(), urls.end());
+    }
+    // Only refresh last_seen, on disk too for the rows which are not loaded in memory
+    void touch_urls(const std::vector<std::string>& urls, const std::string& last_seen) {
+        std::lock_guard<std::mutex> lck(m_mtx);
+        for (auto& url : urls) m_touched_urls[url] = last_seen;
+    }
+    void mark_images(const std::vector<std::string>& urls) {
+        std::lock_guard<std::mutex> lck(m_mtx);
+        m_images.insert(urls.begin(), urls.end());
+    }
+    void touch_image(const std::string& url, const std::string& last_seen) {
+        std::lock_guard<std::mutex> lck(m_mtx);
+        m_touched_images[url] = last_seen;
+    }
+    void touch_images(const std::vector<std::string>& urls, const std::string& last_seen) {
+        std::lock_guard<std::mutex> lck(m_mtx);
+        for (auto& url : urls) m_touched_images[url] = last_seen;
+    }
+    // Pages visited again, their rows are usually not loaded in memory
+    void revisit_url(const std::string& url, const std::string& last_crawled, const PageValidators& validators) {
+        std::lock_guard<std::mutex> lck(m_mtx);
+        m_revisited_urls[url] = std::make_pair(last_crawled, validators);
+    }
+    // Texts of a known image extracted again from a replayed page, its row is usually not loaded in memory
+    void retext_image(const std::string& url, const std::string& alt, const std::string& surrounding) {
+        std::lock_guard<std::mutex> lck(m_mtx);
+        m_retexted_images[url] = std::make_pair(alt, surrounding);
+    }
+    void add_blob(ImageBlob blob) {
+        std::lock_guard<std::mutex> lck(m_mtx);
+        m_blobs.push_back(std::move(blob));
+    }
+    void remove_urls(const std::vector<std::string>& urls) {
+        std::lock_guard<std::mutex> lck(m_mtx);
+        for (auto& url : urls) m_urls.erase(url);
+        m_removed_urls.insert(urls.begin(), urls.end());
+    }
+    void remove_images(const std::vector<std::string>& urls) {
+        std::lock_guard<std::mutex> lck(m_mtx);
+        for (auto& url : urls) m_images.erase(url);
+        m_removed_images.insert(urls.begin(), urls.end());
+    }
+    void flush() {
+        std::lock_guard<std::mutex> flush_lck(m_flush_mtx);
+        std::unordered_set<std::string> urls, images, removed_urls, removed_images, spilled_urls;
+        std::unordered_map<std::string, std::string> touched_urls, touched_images;
+        std::unordered_map<std::string, std::pair<std::string, PageValidators>> revisited_urls;
+        std::unordered_map<std::string, std::pair<std::string, std::string>> retexted_images;
+        std::vector<ImageBlob> blobs;
+        std::unique_lock<std::mutex> lck(m_mtx);
+        urls.swap(m_urls);
+        spilled_urls.swap(m_spilled_urls);
+        retexted_images.swap(m_retexted_images);
+        blobs.swap(m_blobs);
+        revisited_urls.swap(m_revisited_urls);
+        images.swap(m_images);
+        touched_urls.swap(m_touched_urls);
+        touched_images.swap(m_touched_images);
+        removed_urls.swap(m_removed_urls);
+        removed_images.swap(m_removed_images);
+        lck.unlock();
+
+        // Read the changed rows by small batches so the crawling threads are never held for long
+        std::vector<UrlData> urls_data;
+        std::vector<ImageData> images_data;
+        std::vector<std::string> keys;
+        auto read_batches = [&keys](const std::unordered_set<std::string>& set, auto read) {
+            keys.clear();
+            for (auto it = set.begin(); it != set.end(); ) {
+                keys.push_back(*it++);
+                if (keys.size() == batch_size || it == set.end()) {
+                    read(keys);
+                    keys.clear();
+                }
+            }
+        };
+        read_batches(urls, [&urls_data](const std::vector<std::string>& batch) {
+            std::lock_guard<DbMutex> db_lck(mtx);
+            auto rows = memory_storage.get_all<UrlData>(where(in(&UrlData::url, batch)));
+            std::move(rows.begin(), rows.end(), std::back_inserter(urls_data));
+            });
+        read_batches(images, [&images_data](const std::vector<std::string>& batch) {
+            std::lock_guard<DbMutex> db_lck(mtx);
+            auto rows = memory_storage.get_all<ImageData>(where(in(&ImageData::url, batch)));
+            std::move(rows.begin(), rows.end(), std::back_inserter(images_data));
+            });
+
+        // Group the last_seen refreshes by timestamp (one per crawled page)
+        std::map<std::string, std::unordered_set<std::string>> touched_urls_by_time, touched_images_by_time;
+        for (auto& it : touched_urls) touched_urls_by_time[it.second].insert(it.first);
+        for (auto& it : touched_images) touched_images_by_time[it.second].insert(it.first);
+
+        // Append them into the disk-based database
+        storage.transaction([&]() mutable {
+            for (auto& it : touched_urls_by_time) {
+                const std::string& last_seen = it.first;
+                read_batches(it.second, [&last_seen](const std::vector<std::string>& batch) { storage.update_all(set(c(&UrlData::last_seen) = last_seen), where(in(&UrlData::url, batch))); });
+            }
+            for (auto& it : touched_images_by_time) {
+                const std::string& last_seen = it.first;
+                read_batches(it.second, [&last_seen](const std::vector<std::string>& batch) { storage.update_all(set(c(&ImageData::last_seen) = last_seen), where(in(&ImageData::url, batch))); });
+            }
+            for (auto& it : revisited_urls) {
+                const PageValidators& v = it.second.second;
+                storage.update_all(set(c(&UrlData::last_crawled) = std::make_unique<std::string>(it.second.first), c(&UrlData::status_code) = 200,
+                    c(&UrlData::etag) = v.etag, c(&UrlData::last_modified) = v.last_modified, c(&UrlData::content_hash) = v.content_hash,
+                    c(&UrlData::revisit_interval) = v.revisit_interval, c(&UrlData::next_crawl) = v.next_crawl), where(c(&UrlData::url) == it.first));
+            }
+            for (auto& it : retexted_images) {
+                storage.update_all(set(c(&ImageData::alt) = std::make_unique<std::string>(it.second.first), c(&ImageData::surrounding_text) = std::make_unique<std::string>(it.second.second)),
+                    where(c(&ImageData::url) == it.first));
+            }
+            for (size_t i = 0; i < urls_data.size(); i += batch_size) storage.replace_range(urls_data.begin() + i, urls_data.begin() + std::min(i + batch_size, urls_data.size()));
+            for (size_t i = 0; i < images_data.size(); i += batch_size) storage.replace_range(images_data.begin() + i, images_data.begin() + std::min(i + batch_size, images_data.size()));
+            for (size_t i = 0; i < blobs.size(); i += batch_size) storage.replace_range(blobs.begin() + i, blobs.begin() + std::min(i + batch_size, blobs.size()));
+            read_batches(removed_urls, [](const std::vector<std::string>& batch) { storage.remove_all<UrlData>(where(in(&UrlData::url, batch))); });
+            read_batches(removed_images, [](const std::vector<std::string>& batch) { storage.remove_all<ImageData>(where(in(&ImageData::url, batch))); });
+            return true;
+            });
+
+        // Only the rows the crawl is working on stay in memory: the rows whose crawl succeeded and those of the spilled URLs
+        // (written by this flush or an earlier one) are dropped, unless they changed again meanwhile. The failed rows wait
+        // for purge_failed_rows, the later changes of the others go to the disk
+        std::unordered_set<std::string> done_urls(std::move(spilled_urls)), done_images;
+        for (auto& row : urls_data) if (row.last_crawled != nullptr && !row.last_crawled->empty() && row.status_code == 200) done_urls.insert(row.url);
+        for (auto& row : images_data) if (row.mime != nullptr && !row.mime->empty() && *row.mime != unsupported_image_mime) done_images.insert(row.url);
+        read_batches(done_urls, [this](const std::vector<std::string>& batch) {
+            std::lock_guard<DbMutex> db_lck(mtx);
+            std::lock_guard<std::mutex> lck(m_mtx);
+            std::vector<std::string> unchanged;
+            for (auto& url : batch) if (m_urls.count(url) == 0) unchanged.push_back(url);
+            if (!unchanged.empty()) memory_storage.remove_all<UrlData>(where(in(&UrlData::url, unchanged)));
+            });
+        read_batches(done_images, [this](const std::vector<std::string>& batch) {
+            std::lock_guard<DbMutex> db_lck(mtx);
+            std::lock_guard<std::mutex> lck(m_mtx);
+            std::vector<std::string> unchanged;
+            for (auto& url : batch) if (m_images.count(url) == 0) unchanged.push_back(url);
+            if (!unchanged.empty()) memory_storage.remove_all<ImageData>(where(in(&ImageData::url, unchanged)));
+            });
+    }
+
+private:
+    static const size_t batch_size = 100;
+    std::mutex m_mtx, m_flush_mtx;
+    std::unordered_set<std::string> m_urls, m_images, m_removed_urls, m_removed_images, m_spilled_urls;
+    std::unordered_map<std::string, std::string> m_touched_urls, m_touched_images;
+    std::unordered_map<std::string, std::pair<std::string, PageValidators>> m_revisited_urls;
+    std::unordered_map<std::string, std::pair<std::string, std::string>> m_retexted_images;
+    std::vector<ImageBlob> m_blobs;
+};
+Persister persister;
+// The memory only holds the rows the crawl is working on as long as the changes are written back, thus the persister
+// always runs: every persist_time seconds with the auto flush, every auto_flush_time seconds otherwise
+void persister_writer(const size_t interval) {
+    ElapsedTime persist_timer;
+    while (!stop_requested) {
+        std::this_thread::sleep_for(std::chrono::seconds(1));
+        if (persist_timer.getSeconds() < interval) continue;
+        persister.flush();
+        persist_timer.reset();
+    }
+}
+// Rows of the URLs read back from a frontier segment: those dropped from memory are loaded from the disk
+void reload_spilled_urls(const std::vector<std::string>& urls) {
+    persister.unspill_urls(urls); // First, so that no flush drops them any more
+    const size_t max_bound_urls = 500;
+    for (size_t i = 0; i < urls.size(); i += max_bound_urls) {
+        std::vector<std::string> bound_urls(urls.begin() + i, urls.begin() + std::min(i + max_bound_urls, urls.size()));
+        std::unique_lock<DbMutex> lck(mtx);
+        auto loaded = memory_storage.select(&UrlData::url, where(in(&UrlData::url, bound_urls)));
+        lck.unlock();
+        const std::unordered_set<std::string> in_memory(loaded.begin(), loaded.end());
+        bound_urls.erase(std::remove_if(bound_urls.begin(), bound_urls.end(), [&in_memory](const std::string& url) { return in_memory.count(url) != 0; }), bound_urls.end());
+        if (bound_urls.empty()) continue;
+        // Written and committed before being dropped, the read connection sees them
+        auto rows = get_lookup_storage().get_all<UrlData>(where(in(&UrlData::url, bound_urls) and (is_null(&UrlData::last_crawled) or c(&UrlData::last_crawled) == "")));
+        lck.lock();
+        memory_storage.transaction([&]() mutable {
+            for (auto& row : rows) {
+                try { memory_storage.insert(row); }
+                catch (std::system_error&) { continue; }
+            }
+            return true;
+            });
+    }
+}
+
+// Drop the URLs in error and the unsupported images, from memory now and from disk at the next flush
+void purge_failed_rows() {
+    std::unique_lock<DbMutex> lck(mtx);
+    auto failed_urls = memory_storage.select(&UrlData::url, where((c(&UrlData::last_crawled) != "") and (c(&UrlData::status_code) != 200)));
+    auto failed_images = memory_storage.select(&ImageData::url, where(c(&ImageData::mime) == unsupported_image_mime));
+    memory_storage.transaction([&]() mutable {
+        memory_storage.remove_all<UrlData>(where((c(&UrlData::last_crawled) != "") and (c(&UrlData::status_code) != 200)));
+        memory_storage.remove_all<ImageData>(where(c(&ImageData::mime) == unsupported_image_mime));
+        return true;
+        });
+    lck.unlock();
+    for (auto& url : failed_urls) dropped_urls.insert(url_fingerprint(url));
+    for (auto& url : failed_images) dropped_images.insert(url_fingerprint(url));
+    persister.remove_urls(failed_urls);
+    persister.remove_images(failed_images);
+}
+
+// Crawl results waiting to be written back into the urls table, flushed in the background
+class CrawlLog {
+public:
+    void record(const std::string& url, size_t status_code) {
+        std::lock_guard<std::mutex> lck(m_mtx);
+        m_entries.push_back({ url, get_current_time(), status_code, false });
+    }
+    void record(const std::string& url, size_t status_code, const PageValidators& validators) {
+        if (status_code == 200 && !validators.revisit && !replaying) visited_pages++; // A replayed page was counted by its crawl
+        std::lock_guard<std::mutex> lck(m_mtx);
+        m_entries.push_back({ url, get_current_time(), status_code, true, validators });
+    }
+    void flush() {
+        std::vector<Entry> entries;
+        std::unique_lock<std::mutex> lck(m_mtx);
+        entries.swap(m_entries);
+        lck.unlock();
+        if (entries.empty()) return;
+        std::lock_guard<DbMutex> db_lck(mtx);
+        memory_storage.transaction([&]() mutable {
+            for (auto& e : entries) {
+                if (e.has_validators) {
+                    const PageValidators& v = e.validators;
+                    memory_storage.update_all(set(c(&UrlData::last_crawled) = std::make_unique<std::string>(e.last_crawled), c(&UrlData::status_code) = e.status_code,
+                        c(&UrlData::etag) = v.etag, c(&UrlData::last_modified) = v.last_modified, c(&UrlData::content_hash) = v.content_hash,
+                        c(&UrlData::revisit_interval) = v.revisit_interval, c(&UrlData::next_crawl) = v.next_crawl), where(c(&UrlData::url) == e.url));
+                    if (v.revisit) persister.revisit_url(e.url, e.last_crawled, v);
+                }
+                else {
+                    memory_storage.update_all(set(c(&UrlData::last_crawled) = std::make_unique<std::string>(e.last_crawled), c(&UrlData::status_code) = e.status_code),
+                        where(c(&UrlData::url) == e.url));
+                }
+                persister.mark_url(e.url);
+            }
+            return true;
+            });
+    }
+
+private:
+    struct Entry {
+        std::string url;
+        std::string last_crawled;
+        size_t status_code;
+        bool has_validators;
+        PageValidators validators;
+    };
+    std::mutex m_mtx;
+    std::vector<Entry> m_entries;
+};
+CrawlLog crawl_log;
+void crawl_log_writer() {
+    while (!stop_requested) {
+        std::this_thread::sleep_for(std::chrono::seconds(1));
+        crawl_log.flush();
+    }
+}
+
+// Revisits of the crawled pages: each page has its own interval, halved when the page changed since the previous
+// visit and doubled when it did not. The validators of the pages being revisited are kept aside for the conditional requests
+class RecrawlScheduler {
+public:
+    void enable() { m_enabled = true; }
+    bool enabled() const { return m_enabled; }
+    void add(std::string url, PageValidators validators, const std::time_t next_crawl) {
+        std::lock_guard<std::mutex> lck(m_mtx);
+        m_queue.emplace(next_crawl, url);
+        m_pages.emplace(std::move(url), std::move(validators));
+    }
+    // Move up to max_count pages due for a visit into the frontier
+    size_t schedule_due(const std::time_t now, const size_t max_count) {
+        std::vector<std::string> urls;
+        std::unique_lock<std::mutex> lck(m_mtx);
+        while (!m_queue.empty() && m_queue.top().first <= now && urls.size() < max_count) {
+            auto it = m_pages.find(m_queue.top().second);
+            m_queue.pop();
+            if (it == m_pages.end()) continue;
+            urls.push_back(it->first);
+            m_due.insert(std::move(*it));
+            m_pages.erase(it);
+        }
+        lck.unlock();
+        frontier.push_all(urls);
+        return urls.size();
+    }
+    bool request_validators(const std::string& url, std::string& etag, std::string& last_modified) {
+        std::lock_guard<std::mutex> lck(m_mtx);
+        auto it = m_due.find(url);
+        if (it == m_due.end()) return false;
+        etag = it->second.etag;
+        last_modified = it->second.last_modified;
+        return !etag.empty() || !last_modified.empty();
+    }
+    bool revisiting(const std::string& url) {
+        std::lock_guard<std::mutex> lck(m_mtx);
+        return m_due.find(url) != m_due.end();
+    }
+    // A page has been downloaded (or was not modified when content_hash is empty): plan its next visit.
+    // Returns false when the content did not change since the previous visit
+    bool visited(const std::string& url, const std::string& etag, const std::string& last_modified, const std::string& content_hash, PageValidators& validators) {
+        std::lock_guard<std::mutex> lck(m_mtx);
+        bool changed = true;
+        auto it = m_due.find(url);
+        if (it != m_due.end()) {
+            validators = std::move(it->second);
+            m_due.erase(it);
+            validators.revisit = true;
+            changed = !content_hash.empty() && content_hash != validators.content_hash;
+            validators.revisit_interval = changed ? std::max(min_revisit_interval, validators.revisit_interval / 2) : std::min(max_revisit_interval, validators.revisit_interval * 2);
+            if (changed) m_changed++;
+            else m_unchanged++;
+        }
+        else {
+            validators = PageValidators();
+            validators.revisit_interval = initial_revisit_interval;
+        }
+        if (changed || !etag.empty()) validators.etag = etag;
+        if (changed || !last_modified.empty()) validators.last_modified = last_modified;
+        if (!content_hash.empty()) validators.content_hash = content_hash;
+        const std::time_t next_crawl = std::time(nullptr) + validators.revisit_interval;
+        validators.next_crawl = format_time(next_crawl);
+        if (m_enabled) {
+            m_queue.emplace(next_crawl, url);
+            m_pages.emplace(url, validators);
+        }
+        return changed;
+    }
+    // The revisit failed, retry later. Returns false when the page was not being revisited
+    bool failed(const std::string& url) {
+        std::lock_guard<std::mutex> lck(m_mtx);
+        auto it = m_due.find(url);
+        if (it == m_due.end()) return false;
+        it->second.revisit_interval = std::min(max_revisit_interval, it->second.revisit_interval * 2);
+        m_queue.emplace(std::time(nullptr) + it->second.revisit_interval, url);
+        m_pages.insert(std::move(*it));
+        m_due.erase(it);
+        return true;
+    }
+    size_t size() {
+        std::lock_guard<std::mutex> lck(m_mtx);
+        return m_pages.size() + m_due.size();
+    }
+    size_t changed() const { return m_changed; }
+    size_t unchanged() const { return m_unchanged; }
+
+private:
+    using Visit = std::pair<std::time_t, std::string>;
+    bool m_enabled = false;
+    std::mutex m_mtx;
+    std::priority_queue<Visit, std::vector<Visit>, std::greater<Visit>> m_queue;
+    std::unordered_map<std::string, PageValidators> m_pages, m_due;
+    std::atomic<size_t> m_changed = 0, m_unchanged = 0;
+};
+RecrawlScheduler recrawl_scheduler;
+
+// Common stop words in English, French, German, Spanish, and Italian, in their case folded UTF-8 form
+constexpr std::array<std::string_view, 158> stop_word_list = {
+    "a", "an", "the", "and", "but", "or", "if", "while", "of", "at", "by", "for", "with",
+    "about", "against", "between", "into", "through", "during", "before", "after", "above",
+    "below", "to", "from", "in", "out", "on", "off", "over", "under", "again", "further",
+    "then", "once", "here", "there", "when", "where", "why", "how", "all", "any", "both",
+    "each", "few", "more", "most", "other", "some", "such", "no", "nor", "not", "only",
+    "own", "same", "so", "than", "too", "very", "can", "will", "just", "don", "should",
+    "now", "com", "je", "tu", "il", "elle", "nous", "vous", "ils", "elles", "le", "la",
+    "les", "un", "une", "des", "fr", "der", "die", "das", "ein", "eine", "eines", "einem",
+    "einen", "de", "el", "los", "las", "una", "unos", "unas", "es", "di", "che", "e", "per",
+    "con", "su", "da", "del", "della", "dello", "dei", "degli", "delle", "al", "dal", "dalla",
+    "dai", "dagli", "alle", "col", "sul", "sull", "sulla", "sullo", "sui", "sugli", "sulle",
+    "nei", "negli", "nelle", "perch\xc3\xa9", "cos\xc3\xac", "quindi", "allora", "anche", "come",
+    "dove", "quando", "chi", "non", "mai", "pi\xc3\xb9", "meno", "tuttavia", "ovunque",
+    "altrove", "addirittura", "sempre", "gi\xc3\xa0", "appena", "proprio", "nient", "altro",
+    "nulla", "qualcosa", "qualcuno", "tutt", "solamente", "it"
+};
+
+// Perfect hash of the stop words: the seed was searched offline so that every word gets its own slot
+constexpr uint32_t stop_word_seed = 327;
+constexpr size_t stop_word_slots = 2048;
+constexpr size_t stop_word_slot(std::string_view word) {
+    uint32_t h = stop_word_seed;
+    for (char ch : word) {
+        h ^= static_cast<unsigned char>(ch);
+        h *= 16777619u;
+    }
+    h ^= h >> 15;
+    h *= 0x2c1b3c6du;
+    h ^= h >> 12;
+    return h & (stop_word_slots - 1);
+}
+struct StopWordTable {
+    std::array<uint8_t, stop_word_slots> slots{};
+    bool collision_free = true;
+};
+constexpr StopWordTable make_stop_word_table() {
+    StopWordTable table;
+    for (size_t slot = 0; slot < stop_word_slots; ++slot) table.slots[slot] = 0xFF;
+    for (size_t i = 0; i < stop_word_list.size(); ++i) {
+        const size_t slot = stop_word_slot(stop_word_list[i]);
+        if (table.slots[slot] != 0xFF) table.collision_free = false;
+        table.slots[slot] = static_cast<uint8_t>(i);
+    }
+    return table;
+}
+constexpr StopWordTable stop_word_table = make_stop_word_table();
+static_assert(stop_word_list.size() < 0xFF, "Stop word indexes must fit in a byte");
+static_assert(stop_word_table.collision_free, "Stop word hash collision, another seed must be searched");
+inline bool is_stop_word(std::string_view word) {
+    const uint8_t index = stop_word_table.slots[stop_word_slot(word)];
+    return index != 0xFF && stop_word_list[index] == word;
+}
+
+// Simple case folding of the Latin, Greek and Cyrillic letters
+uint32_t fold_code_point(uint32_t cp) {
+    if (cp < 0x80) return (cp >= 'A' && cp <= 'Z') ? cp + 32 : cp;
+    if (cp < 0x100) return (cp >= 0xC0 && cp <= 0xDE && cp != 0xD7) ? cp + 32 : cp;
+    if (cp < 0x180) {
+        if (cp == 0x130) return 'i';
+        if (cp == 0x178) return 0xFF;
+        if ((cp < 0x138 || (cp >= 0x14A && cp < 0x178)) && (cp & 1) == 0) return cp + 1;
+        if (((cp >= 0x139 && cp < 0x149) || (cp >= 0x179 && cp < 0x17F)) && (cp & 1) == 1) return cp + 1;
+        return cp;
+    }
+    if (cp >= 0x386 && cp < 0x3AC) {
+        if (cp >= 0x391 && cp != 0x3A2) return cp + 32;
+        if (cp == 0x386) return 0x3AC;
+        if (cp >= 0x388 && cp <= 0x38A) return cp + 37;
+        if (cp == 0x38C) return 0x3CC;
+        if (cp == 0x38E || cp == 0x38F) return cp + 63;
+        return cp;
+    }
+    if (cp >= 0x400 && cp < 0x410) return cp + 80;
+    if (cp >= 0x410 && cp < 0x430) return cp + 32;
+    return cp;
+}
+inline bool is_word_separator(uint32_t cp) {
+    if (cp < 0x80) return cp == 0 || std::strchr(" \t\n\r\f\v.,:;!?#@[]{}|\"&", static_cast<int>(cp)) != nullptr;
+    return cp == 0xA0 || (cp >= 0x2000 && cp <= 0x200B) || cp == 0x202F || cp == 0x3000;
+}
+void append_utf8(std::string& output, uint32_t cp) {
+    if (cp < 0x80) {
+        output += static_cast<char>(cp);
+    }
+    else if (cp < 0x800) {
+        output += static_cast<char>(0xC0 | (cp >> 6));
+        output += static_cast<char>(0x80 | (cp & 0x3F));
+    }
+    else if (cp < 0x10000) {
+        output += static_cast<char>(0xE0 | (cp >> 12));
+        output += static_cast<char>(0x80 | ((cp >> 6) & 0x3F));
+        output += static_cast<char>(0x80 | (cp & 0x3F));
+    }
+    else {
+        output += static_cast<char>(0xF0 | (cp >> 18));
+        output += static_cast<char>(0x80 | ((cp >> 12) & 0x3F));
+        output += static_cast<char>(0x80 | ((cp >> 6) & 0x3F));
+        output += static_cast<char>(0x80 | (cp & 0x3F));
+    }
+}
+
+// Normalize a text in a single pass: decode UTF-8, fold the case, split the words, drop the stop words,
+// collapse the separators into single spaces and stop at the first word boundary past max_str_length
+void remove_stop_words(std::string& input) {
+    std::string output;
+    output.reserve(std::min(input.size(), max_str_length + 64));
+    const unsigned char* p = reinterpret_cast<const unsigned char*>(input.data());
+    const unsigned char* end = p + input.size();
+    size_t word_start = std::string::npos, separator_pos = 0;
+    bool truncated = false;
+    while (p < end) {
+        uint32_t cp = *p;
+        size_t len = 1;
+        bool raw = false;
+        if (cp >= 0x80) {
+            len = cp >= 0xF8 ? 0 : cp >= 0xF0 ? 4 : cp >= 0xE0 ? 3 : cp >= 0xC0 ? 2 : 0;
+            if (len == 0 || static_cast<size_t>(end - p) < len) {
+                len = 1;
+                raw = true; // Invalid sequence, the byte is kept as is
+            }
+            else {
+                cp &= 0x7F >> len;
+                for (size_t i = 1; i < len && !raw; ++i) {
+                    if ((p[i] & 0xC0) != 0x80) raw = true;
+                    cp = (cp << 6) | (p[i] & 0x3F);
+                }
+                if (raw) {
+                    cp = *p;
+                    len = 1;
+                }
+            }
+        }
+        if (!raw && is_word_separator(cp)) {
+            if (word_start != std::string::npos) {
+                if (is_stop_word(std::string_view(output).substr(word_start))) output.resize(separator_pos);
+                word_start = std::string::npos;
+            }
+        }
+        else {
+            if (word_start == std::string::npos) {
+                if (output.size() >= max_str_length) {
+                    truncated = true;
+                    break;
+                }
+                separator_pos = output.size();
+                if (!output.empty()) output += ' ';
+                word_start = output.size();
+            }
+            if (raw) output += static_cast<char>(*p);
+            else append_utf8(output, fold_code_point(cp));
+        }
+        p += len;
+    }
+    if (word_start != std::string::npos && is_stop_word(std::string_view(output).substr(word_start))) output.resize(separator_pos);
+    if (!truncated && output.size() > max_str_length) {
+        // The last word crosses the limit, cut it on a character boundary
+        size_t cut = max_str_length;
+        while (cut > 0 && (static_cast<unsigned char>(output[cut]) & 0xC0) == 0x80) --cut;
+        output.resize(cut);
+    }
+    input.swap(output);
+}
+
+// URL resolution following RFC 3986 (section 5.2), working on string views without any regex
+struct UrlParts {
+    std::string_view scheme, authority, path, query;
+    bool has_scheme = false, has_authority = false, has_query = false, has_fragment = false;
+};
+void parse_url(std::string_view url, UrlParts& parts) {
+    parts = UrlParts();
+    const size_t fragment_pos = url.find('#');
+    if (fragment_pos != std::string_view::npos) {
+        url = url.substr(0, fragment_pos);
+        parts.has_fragment = true;
+    }
+    // Scheme: ALPHA *( ALPHA / DIGIT / "+" / "-" / "." ) ":"
+    if (!url.empty() && std::isalpha(static_cast<unsigned char>(url[0]))) {
+        size_t i = 1;
+        while (i < url.size() && (std::isalnum(static_cast<unsigned char>(url[i])) || url[i] == '+' || url[i] == '-' || url[i] == '.')) i++;
+        if (i < url.size() && url[i] == ':') {
+            parts.scheme = url.substr(0, i);
+            parts.has_scheme = true;
+            url = url.substr(i + 1);
+        }
+    }
+    if (url.size() >= 2 && url[0] == '/' && url[1] == '/') {
+        const size_t end = url.find_first_of("/?", 2);
+        parts.authority = url.substr(2, end == std::string_view::npos ? std::string_view::npos : end - 2);
+        parts.has_authority = true;
+        url = (end == std::string_view::npos) ? std::string_view() : url.substr(end);
+    }
+    const size_t query_pos = url.find('?');
+    if (query_pos != std::string_view::npos) {
+        parts.query = url.substr(query_pos + 1);
+        parts.has_query = true;
+        url = url.substr(0, query_pos);
+    }
+    parts.path = url;
+}
+// Remove the "." and ".." segments of a path (RFC 3986, section 5.2.4) and append it to the output
+void append_path(std::string_view path, std::string& output) {
+    const size_t root = output.size();
+    while (!path.empty()) {
+        if (path.compare(0, 3, "../") == 0) path.remove_prefix(3);
+        else if (path.compare(0, 2, "./") == 0) path.remove_prefix(2);
+        else if (path.compare(0, 3, "/./") == 0) path.remove_prefix(2);
+        else if (path == "/.") path = "/";
+        else if (path.compare(0, 4, "/../") == 0 || path == "/..") {
+            path = (path.size() == 3) ? std::string_view("/") : path.substr(3);
+            const size_t last = output.find_last_of('/');
+            output.resize((last == std::string::npos || last < root) ? root : last);
+        }
+        else if (path == "." || path == "..") path = std::string_view();
+        else {
+            const size_t end = path.find('/', 1);
+            output.append(path.substr(0, end));
+            path = (end == std::string_view::npos) ? std::string_view() : path.substr(end);
+        }
+    }
+}
+// Scheme names are case insensitive
+bool is_scheme(std::string_view scheme, std::string_view expected) {
+    return scheme.size() == expected.size() && std::equal(scheme.begin(), scheme.end(), expected.begin(),
+        [](char a, char b) { return std::tolower(static_cast<unsigned char>(a)) == std::tolower(static_cast<unsigned char>(b)); });
+}
+// Top level domains used to recognize links made of a bare domain name ("www.site.com")
+const std::array<std::string_view, 134> known_tlds = {
+    "ad", "ae", "al", "am", "aq", "at", "au", "az", "be", "bf", "bg", "bh", "bi", "biz", "bv", "bw", "by", "ca", "cf",
+    "cg", "ch", "ci", "cm", "cn", "com", "cv", "cy", "cz", "de", "dj", "dk", "dz", "edu", "ee", "eg", "er", "es", "et",
+    "fi", "fr", "ga", "ge", "gh", "gn", "gov", "gq", "gr", "gs", "gw", "hm", "hr", "hu", "ie", "il", "in", "info",
+    "iq", "ir", "is", "it", "jo", "jp", "ke", "kg", "km", "kw", "kz", "lb", "li", "lr", "ls", "lt", "lu", "lv", "ly",
+    "ma", "mc", "md", "mg", "mil", "mr", "mt", "mu", "museum", "mw", "na", "name", "ne", "net", "nf", "ng", "nl", "no",
+    "nz", "om", "org", "pl", "ps", "pt", "qa", "re", "ro", "rs", "ru", "rw", "sa", "sc", "sd", "se", "sk", "sl", "sm",
+    "sn", "so", "st", "sy", "sz", "td", "tf", "tg", "tm", "tn", "tr", "ua", "ug", "uk", "us", "uz", "va", "ye", "yt",
+    "za", "zm", "zw"
+};
+bool ends_with_known_tld(std::string_view link) {
+    const size_t dot = link.find_last_of('.');
+    if (dot == std::string_view::npos || dot == 0 || dot + 1 == link.size() || dot + 1 + 6 < link.size()) return false;
+    char tld[8] = { 0 };
+    for (size_t i = dot + 1; i < link.size(); ++i) tld[i - dot - 1] = static_cast<char>(std::tolower(static_cast<unsigned char>(link[i])));
+    return std::binary_search(known_tlds.begin(), known_tlds.end(), std::string_view(tld, link.size() - dot - 1));
+}
+std::string get_abs_url(const std::string& link, const std::string& base_url, const bool for_image) {
+    UrlParts base, ref;
+    parse_url(base_url, base);
+    if (!base.has_authority || !(is_scheme(base.scheme, "http") || is_scheme(base.scheme, "https"))) return "";
+    if (link.empty() || link.size() >= max_url_length) return "";
+    parse_url(link, ref);
+    if (ref.has_scheme && !is_scheme(ref.scheme, "http") && !is_scheme(ref.scheme, "https")) return ""; // javascript:, mailto:, data:...
+    if (ref.has_scheme && !ref.has_authority && is_scheme(ref.scheme, base.scheme)) ref.has_scheme = false; // "http:g" (section 5.2.2)
+    if (!ref.has_scheme && !ref.has_authority && !ref.path.empty() && ref.path.find('/') == std::string_view::npos && !ref.has_query && !ref.has_fragment && ends_with_known_tld(ref.path)) {
+        // Link made of a domain name only ("script.pl?x=1" and "readme.md#intro" stay relative paths)
+        ref.authority = ref.path;
+        ref.has_authority = true;
+        ref.path = std::string_view();
+    }
+
+    // Build the target URL: lower case scheme and host, without default port, fragment and (for images) query
+    const UrlParts& origin = ref.has_scheme ? ref : base;
+    std::string abs_url;
+    abs_url.reserve(base_url.size() + link.size());
+    for (char ch : origin.scheme) abs_url += static_cast<char>(std::tolower(static_cast<unsigned char>(ch)));
+    abs_url += "://";
+    std::string_view authority = (ref.has_scheme || ref.has_authority) ? ref.authority : base.authority;
+    const size_t host_start = abs_url.size();
+    for (char ch : authority) abs_url += static_cast<char>(std::tolower(static_cast<unsigned char>(ch)));
+    if (abs_url.size() > host_start + 3 && abs_url.compare(abs_url.size() - 3, 3, ":80") == 0 && abs_url.compare(0, 5, "http:") == 0) abs_url.resize(abs_url.size() - 3);
+    else if (abs_url.size() > host_start + 4 && abs_url.compare(abs_url.size() - 4, 4, ":443") == 0 && abs_url.compare(0, 6, "https:") == 0) abs_url.resize(abs_url.size() - 4);
+    if (abs_url.size() == host_start) return "";
+
+    std::string_view query = ref.query;
+    bool has_query = ref.has_query;
+    if (ref.has_scheme || ref.has_authority || (!ref.path.empty() && ref.path[0] == '/')) {
+        append_path(ref.path, abs_url);
+    }
+    else if (ref.path.empty()) {
+        append_path(base.path, abs_url);
+        if (!has_query) {
+            query = base.query;
+            has_query = base.has_query;
+        }
+    }
+    else { // Merge the relative path with the directory of the base path
+        const size_t last = base.path.find_last_of('/');
+        std::string merged = (last == std::string_view::npos) ? std::string("/") : std::string(base.path.substr(0, last + 1));
+        merged.append(ref.path);
+        append_path(merged, abs_url);
+    }
+    if (has_query && !for_image) {
+        abs_url += '?';
+        abs_url.append(query);
+    }
+    if (abs_url.back() == '/') abs_url.pop_back();
+    boost::replace_all(abs_url, " ", "%20");
+    return (abs_url.size() < max_url_length ? abs_url : "");
+}
+
+// Helper function to extract image links from a page and download source images
+std::string calculate_md5_from_path(boost::filesystem::path& p) {
+    std::string file_name = p.filename().string();
+    std::string sub_folder_name = p.parent_path().filename().string();
+    std::string top_folder_name = p.parent_path().parent_path().filename().string();
+    return (top_folder_name + sub_folder_name + file_name.substr(0, file_name.find_last_of('.')));
+}
+void get_file_folder(const std::string& md5_hash, std::string& folder_pathname) {
+    // Split the MD5 hash into two parts: the first 2 characters and the remaining characters
+    std::string top_folder_name = md5_hash.substr(0, 1);
+    std::string sub_folder_name = md5_hash.substr(1, 1);
+    std::string file_name = md5_hash.substr(2);
+
+    // Construct the destination folder path based on the top folder name and subfolder name
+    folder_pathname = boost::filesystem::current_path().string() + "/img_cache";
+    if (!boost::filesystem::exists(folder_pathname)) boost::filesystem::create_directory(folder_pathname);
+    folder_pathname += "/" + top_folder_name;
+    if (!boost::filesystem::exists(folder_pathname)) boost::filesystem::create_directory(folder_pathname);
+    folder_pathname += "/" + sub_folder_name;
+    if (!boost::filesystem::exists(folder_pathname)) boost::filesystem::create_directory(folder_pathname);
+    folder_pathname += "/" + file_name + ".jpg";
+}
+// Return the type of an image from its magic bytes ("" if not supported)
+std::string get_image_type(const char* data, const size_t size) {
+    if (size >= 2 && data[0] == (char)0xFF && data[1] == (char)0xD8) return "jpg";
+    /* if (size >= 3 && data[0] == (char)0x47 && data[1] == (char)0x49 && data[2] == (char)0x46) return "gif"; */
+    if (size >= 8 && data[0] == (char)0x89 && data[1] == (char)0x50 && data[2] == (char)0x4E && data[3] == (char)0x47 &&
+        data[4] == (char)0x0D && data[5] == (char)0x0A && data[6] == (char)0x1A && data[7] == (char)0x0A) return "png";
+    return "";
+}
+// Read the image dimensions from the JPEG SOF marker or the PNG IHDR chunk, without decoding pixels
+bool probe_image_dims(const std::string& bytes, const std::string& file_type, size_t& width, size_t& height, size_t& components) {
+    const unsigned char* data = reinterpret_cast<const unsigned char*>(bytes.data());
+    const size_t size = bytes.size();
+    if (file_type == "png") {
+        if (size < 29 || memcmp(data + 12, "IHDR", 4) != 0) return false;
+        width = (size_t(data[16]) << 24) | (size_t(data[17]) << 16) | (size_t(data[18]) << 8) | data[19];
+        height = (size_t(data[20]) << 24) | (size_t(data[21]) << 16) | (size_t(data[22]) << 8) | data[23];
+        components = (data[25] == 2 || data[25] == 6) ? 3 : 1; // Color type
+        return width > 0 && height > 0;
+    }
+    size_t pos = 2;
+    while (pos + 4 <= size) {
+        if (data[pos] != 0xFF) return false;
+        const unsigned char marker = data[pos + 1];
+        if (marker == 0xFF) { // Fill byte
+            pos++;
+            continue;
+        }
+        if (marker == 0x01 || (marker >= 0xD0 && marker <= 0xD8)) { // Markers without payload
+            pos += 2;
+            continue;
+        }
+        if (marker == 0xDA || marker == 0xD9) return false; // Start of scan reached without any frame header
+        const size_t length = (size_t(data[pos + 2]) << 8) | data[pos + 3];
+        if (marker >= 0xC0 && marker <= 0xCF && marker != 0xC4 && marker != 0xC8 && marker != 0xCC) { // SOFn
+            if (pos + 10 > size) return false;
+            height = (size_t(data[pos + 5]) << 8) | data[pos + 6];
+            width = (size_t(data[pos + 7]) << 8) | data[pos + 8];
+            components = data[pos + 9];
+            return width > 0 && height > 0;
+        }
+        pos += 2 + length;
+    }
+    return false;
+}
+// Fast downscaling path: JPEG images are decoded directly at 1/2, 1/4 or 1/8 of their size by libjpeg,
+// then brought to their final dimensions with a vectorized area resampler
+static_assert(sizeof(dlib::rgb_pixel) == 3, "rgb_pixel must be packed");
+void get_resized_dims(const size_t width, const size_t height, size_t& new_width, size_t& new_height) {
+    const double resize_factor = std::min(max_image_dims / (double)width, max_image_dims / (double)height);
+    new_width = static_cast<size_t>(width * resize_factor);
+    new_height = static_cast<size_t>(height * resize_factor);
+}
+struct JpegErrorManager {
+    jpeg_error_mgr pub;
+    jmp_buf setjmp_buffer;
+};
+void jpeg_error_exit(j_common_ptr cinfo) {
+    longjmp(reinterpret_cast<JpegErrorManager*>(cinfo->err)->setjmp_buffer, 1);
+}
+void jpeg_output_message(j_common_ptr cinfo) {}
+bool decode_jpeg_scaled(const std::string& bytes, const size_t min_width, const size_t min_height, std::vector<unsigned char>& rgb, size_t& width, size_t& height) {
+    jpeg_decompress_struct cinfo;
+    JpegErrorManager jerr;
+    cinfo.err = jpeg_std_error(&jerr.pub);
+    jerr.pub.error_exit = jpeg_error_exit;
+    jerr.pub.output_message = jpeg_output_message;
+    if (setjmp(jerr.setjmp_buffer)) {
+        jpeg_destroy_decompress(&cinfo);
+        return false;
+    }
+    jpeg_create_decompress(&cinfo);
+    jpeg_mem_src(&cinfo, reinterpret_cast<const unsigned char*>(bytes.data()), static_cast<unsigned long>(bytes.size()));
+    jpeg_read_header(&cinfo, TRUE);
+    cinfo.out_color_space = JCS_RGB;
+    cinfo.scale_num = 1;
+    cinfo.scale_denom = 1;
+    for (unsigned int denom = 8; denom > 1; denom /= 2) { // Keep the smallest scale still larger than the final image
+        if ((cinfo.image_width + denom - 1) / denom >= min_width && (cinfo.image_height + denom - 1) / denom >= min_height) {
+            cinfo.scale_denom = denom;
+            break;
+        }
+    }
+    jpeg_start_decompress(&cinfo);
+    width = cinfo.output_width;
+    height = cinfo.output_height;
+    rgb.resize(width * height * 3);
+    while (cinfo.output_scanline < cinfo.output_height) {
+        JSAMPROW row = &rgb[cinfo.output_scanline * width * 3];
+        jpeg_read_scanlines(&cinfo, &row, 1);
+    }
+    jpeg_finish_decompress(&cinfo);
+    jpeg_destroy_decompress(&cinfo);
+    return true;
+}
+// JPEG encoding into memory, for the packed store
+bool encode_jpeg(const dlib::array2d<dlib::rgb_pixel>& img, const int quality, std::string& output) {
+    if (img.nr() == 0 || img.nc() == 0) return false;
+    jpeg_compress_struct cinfo;
+    JpegErrorManager jerr;
+    unsigned char* buffer = nullptr;
+    unsigned long size = 0;
+    cinfo.err = jpeg_std_error(&jerr.pub);
+    jerr.pub.error_exit = jpeg_error_exit;
+    jerr.pub.output_message = jpeg_output_message;
+    if (setjmp(jerr.setjmp_buffer)) {
+        jpeg_destroy_compress(&cinfo);
+        free(buffer);
+        return false;
+    }
+    jpeg_create_compress(&cinfo);
+    jpeg_mem_dest(&cinfo, &buffer, &size);
+    cinfo.image_width = static_cast<JDIMENSION>(img.nc());
+    cinfo.image_height = static_cast<JDIMENSION>(img.nr());
+    cinfo.input_components = 3;
+    cinfo.in_color_space = JCS_RGB;
+    jpeg_set_defaults(&cinfo);
+    jpeg_set_quality(&cinfo, quality, TRUE);
+    jpeg_start_compress(&cinfo, TRUE);
+    while (cinfo.next_scanline < cinfo.image_height) {
+        JSAMPROW row = const_cast<JSAMPROW>(reinterpret_cast<const unsigned char*>(&img[cinfo.next_scanline][0]));
+        jpeg_write_scanlines(&cinfo, &row, 1);
+    }
+    jpeg_finish_compress(&cinfo);
+    jpeg_destroy_compress(&cinfo);
+    output.assign(reinterpret_cast<const char*>(buffer), size);
+    free(buffer);
+    return true;
+}
+// Area resampling: each destination pixel is the average of the source area it covers. Rows are first
+// accumulated vertically (contiguous multiply-add, vectorized), then columns are averaged
+void resize_area(const unsigned char* src, const size_t src_width, const size_t src_height, dlib::array2d<dlib::rgb_pixel>& dst) {
+    const size_t dst_width = dst.nc(), dst_height = dst.nr(), row_size = src_width * 3;
+    const float scale_x = src_width / (float)dst_width, scale_y = src_height / (float)dst_height;
+
+    // Horizontal contributions of each source column to each destination column
+    std::vector<size_t> x_first(dst_width), x_count(dst_width);
+    std::vector<float> x_weights;
+    for (size_t dx = 0; dx < dst_width; ++dx) {
+        const float x0 = dx * scale_x, x1 = std::min<float>((float)src_width, x0 + scale_x);
+        x_first[dx] = static_cast<size_t>(x0);
+        x_count[dx] = 0;
+        for (size_t sx = x_first[dx]; sx < src_width && sx < x1; ++sx) {
+            x_weights.push_back((std::min<float>(x1, sx + 1.0f) - std::max<float>(x0, (float)sx)) / scale_x);
+            x_count[dx]++;
+        }
+    }
+
+    std::vector<float> acc(row_size);
+    for (size_t dy = 0; dy < dst_height; ++dy) {
+        const float y0 = dy * scale_y, y1 = std::min<float>((float)src_height, y0 + scale_y);
+        std::fill(acc.begin(), acc.end(), 0.0f);
+        for (size_t sy = static_cast<size_t>(y0); sy < src_height && sy < y1; ++sy) {
+            const float w = (std::min<float>(y1, sy + 1.0f) - std::max<float>(y0, (float)sy)) / scale_y;
+            const unsigned char* in = src + sy * row_size;
+            size_t i = 0;
+#if defined(__SSE2__) || defined(_M_X64)
+            const __m128 wv = _mm_set1_ps(w);
+            const __m128i zero = _mm_setzero_si128();
+            for (; i + 16 <= row_size; i += 16) {
+                const __m128i px = _mm_loadu_si128(reinterpret_cast<const __m128i*>(in + i));
+                const __m128i lo = _mm_unpacklo_epi8(px, zero), hi = _mm_unpackhi_epi8(px, zero);
+                const __m128 f0 = _mm_cvtepi32_ps(_mm_unpacklo_epi16(lo, zero)), f1 = _mm_cvtepi32_ps(_mm_unpackhi_epi16(lo, zero));
+                const __m128 f2 = _mm_cvtepi32_ps(_mm_unpacklo_epi16(hi, zero)), f3 = _mm_cvtepi32_ps(_mm_unpackhi_epi16(hi, zero));
+                _mm_storeu_ps(&acc[i], _mm_add_ps(_mm_loadu_ps(&acc[i]), _mm_mul_ps(f0, wv)));
+                _mm_storeu_ps(&acc[i + 4], _mm_add_ps(_mm_loadu_ps(&acc[i + 4]), _mm_mul_ps(f1, wv)));
+                _mm_storeu_ps(&acc[i + 8], _mm_add_ps(_mm_loadu_ps(&acc[i + 8]), _mm_mul_ps(f2, wv)));
+                _mm_storeu_ps(&acc[i + 12], _mm_add_ps(_mm_loadu_ps(&acc[i + 12]), _mm_mul_ps(f3, wv)));
+            }
+#endif
+            for (; i < row_size; ++i) acc[i] += in[i] * w;
+        }
+        dlib::rgb_pixel* out = &dst[dy][0];
+        const float* weight = x_weights.data();
+        for (size_t dx = 0; dx < dst_width; ++dx) {
+            float r = 0.0f, g = 0.0f, b = 0.0f;
+            const float* a = &acc[x_first[dx] * 3];
+            for (size_t k = 0; k < x_count[dx]; ++k, a += 3) {
+                r += a[0] * weight[k];
+                g += a[1] * weight[k];
+                b += a[2] * weight[k];
+            }
+            weight += x_count[dx];
+            out[dx] = dlib::rgb_pixel(static_cast<unsigned char>(std::min(r + 0.5f, 255.0f)), static_cast<unsigned char>(std::min(g + 0.5f, 255.0f)), static_cast<unsigned char>(std::min(b + 0.5f, 255.0f)));
+        }
+    }
+}
+// Decode, resize and save an oversized image
+void resize_image_fast(const std::string& bytes, const std::string& file_type, const size_t width, const size_t height, dlib::array2d<dlib::rgb_pixel>& size_img) {
+    size_t new_width, new_height;
+    get_resized_dims(width, height, new_width, new_height);
+    size_img.set_size(new_height, new_width);
+    std::vector<unsigned char> rgb;
+    size_t src_width, src_height;
+    if (file_type == "jpg" && decode_jpeg_scaled(bytes, new_width, new_height, rgb, src_width, src_height)) {
+        resize_area(rgb.data(), src_width, src_height, size_img);
+    }
+    else {
+        dlib::array2d<dlib::rgb_pixel> img;
+        if (file_type == "jpg") dlib::load_jpeg(img, reinterpret_cast<const unsigned char*>(bytes.data()), bytes.size());
+        else dlib::load_png(img, reinterpret_cast<const unsigned char*>(bytes.data()), bytes.size());
+        resize_area(reinterpret_cast<const unsigned char*>(&img[0][0]), img.nc(), img.nr(), size_img);
+    }
+}
+void resize_image_fast(const std::string& bytes, const std::string& file_type, const size_t width, const size_t height, const std::string& filename) {
+    dlib::array2d<dlib::rgb_pixel> size_img;
+    resize_image_fast(bytes, file_type, width, height, size_img);
+    dlib::save_jpeg(size_img, filename, 90);
+}
+
+// Validate a downloaded image and read its dimensions, without decoding it
+bool check_image_bytes(const std::string& url, const std::string& bytes, size_t& file_size, size_t& width, size_t& height, size_t& components, std::string& file_type) {
+    // Check the image size and type
+    file_size = bytes.size();
+    if (file_size < min_image_file_size || file_size > max_image_file_size) {
+        if (verbose) std::cerr << "Too small or large image file: " << url << " (" << file_size << " bytes)" << std::endl;
+        return false;
+    }
+    file_type = get_image_type(bytes.data(), bytes.size());
+    if (file_type.empty()) {
+        if (verbose) std::cerr << "Unsupported file type for image " << url << std::endl;
+        return false;
+    }
+
+    if (!probe_image_dims(bytes, file_type, width, height, components)) {
+        if (verbose) std::cerr << "Unable to read dimensions of image " << url << std::endl;
+        return false;
+    }
+    return true;
+}
+
+// JPEG images already within the limits are stored as they are, others are decoded then resized and/or converted
+bool store_image(const std::string& bytes, const std::string& filename, const size_t width, const size_t height, const size_t components, const std::string& file_type) {
+    if (file_type == "jpg" && width <= max_image_dims && height <= max_image_dims && (components == 1 || components == 3)) {
+        auto ouput_file = std::ofstream(filename, std::ios::out | std::ios::binary | std::ios::trunc);
+        if (!ouput_file.is_open()) return false;
+        ouput_file.write(bytes.data(), bytes.size());
+        ouput_file.close();
+        return !ouput_file.fail();
+    }
+
+    // Only the final image is written on disk
+    try {        
+        if (width > max_image_dims || height > max_image_dims) {
+            resize_image_fast(bytes, file_type, width, height, filename);
+        }
+        else {
+            dlib::array2d<dlib::rgb_pixel> img;
+            if (file_type == "jpg") dlib::load_jpeg(img, reinterpret_cast<const unsigned char*>(bytes.data()), bytes.size());
+            else dlib::load_png(img, reinterpret_cast<const unsigned char*>(bytes.data()), bytes.size());
+            dlib::save_jpeg(img, filename, 90);
+        }
+    }
+    catch (std::exception& e) {
+        if (verbose) std::cerr << "Error processing image file: " << filename << " - " << e.what() << std::endl;
+        boost::system::error_code ec;
+        boost::filesystem::remove(filename, ec);
+        return false;
+    }
+
+    return true;
+}
+
+// Images appended to large segment files (img_store/segment_<n>.bin) instead of one file each. Each record is a header
+// (magic, SHA-256 of the content, size) followed by the JPEG bytes, and its location is indexed in the blobs table.
+// Writes are sequential, reads map the segments in memory
+class PackedImageStore {
+public:
+    static const size_t header_size = 40;
+    void open(const boost::filesystem::path& folder) {
+        std::lock_guard<std::mutex> lck(m_mtx);
+        m_folder = folder;
+        boost::system::error_code ec;
+        boost::filesystem::create_directories(m_folder, ec);
+        const std::vector<size_t> list = list_segments();
+        m_segment = list.empty() ? 0 : list.back();
+        m_size = get_segment_size(m_segment);
+    }
+    std::vector<size_t> segments() {
+        std::lock_guard<std::mutex> lck(m_mtx);
+        return list_segments();
+    }
+    size_t segment_size(size_t segment) {
+        std::lock_guard<std::mutex> lck(m_mtx);
+        return get_segment_size(segment);
+    }
+    bool append(const std::string& key, const std::string& data, ImageBlob& blob) {
+        char header[header_size] = { 'F', 'F', 'I', 'M' };
+        if (!from_hex(key, reinterpret_cast<uint8_t*>(header + 4), 32)) return false;
+        for (int i = 0; i < 4; ++i) header[36 + i] = static_cast<char>((data.size() >> (8 * i)) & 0xFF);
+        std::lock_guard<std::mutex> lck(m_mtx);
+        if (m_size > 0 && m_size + header_size + data.size() > packed_segment_size) next_segment();
+        if (!m_writer.is_open()) {
+            m_writer.open(segment_path(m_segment).string(), std::ios::out | std::ios::binary | std::ios::app);
+            if (!m_writer.is_open()) return false;
+        }
+        m_writer.write(header, header_size);
+        m_writer.write(data.data(), data.size());
+        m_writer.flush();
+        if (m_writer.fail()) { // Start again from what actually reached the disk
+            m_writer.close();
+            m_size = get_segment_size(m_segment);
+            return false;
+        }
+        blob = ImageBlob{ key, m_segment, m_size + header_size, data.size() };
+        m_size += header_size + data.size();
+        return true;
+    }
+    // Following appends go into a new segment
+    void start_segment() {
+        std::lock_guard<std::mutex> lck(m_mtx);
+        next_segment();
+    }
+    bool read(const ImageBlob& blob, std::string& data) {
+        std::lock_guard<std::mutex> lck(m_mtx);
+        auto& map = m_maps[blob.segment];
+        try {
+            if (map == nullptr || map->size() < blob.offset + blob.size) { // Not mapped yet, or grown since
+                map.reset();
+                if (get_segment_size(blob.segment) < blob.offset + blob.size) return false;
+                map = std::make_unique<boost::iostreams::mapped_file_source>(segment_path(blob.segment).string());
+            }
+        }
+        catch (std::exception&) {
+            map.reset();
+            return false;
+        }
+        if (map->size() < blob.offset + blob.size) return false;
+        data.assign(map->data() + blob.offset, blob.size);
+        return true;
+    }
+    void remove_segment(size_t segment) {
+        std::lock_guard<std::mutex> lck(m_mtx);
+        m_maps.erase(segment);
+        boost::system::error_code ec;
+        boost::filesystem::remove(segment_path(segment), ec);
+    }
+
+private:
+    boost::filesystem::path segment_path(size_t segment) const {
+        std::stringstream ss;
+        ss << "segment_" << std::setw(8) << std::setfill('0') << segment << ".bin";
+        return m_folder / ss.str();
+    }
+    size_t get_segment_size(size_t segment) const {
+        boost::system::error_code ec;
+        const auto size = boost::filesystem::file_size(segment_path(segment), ec);
+        return ec ? 0 : static_cast<size_t>(size);
+    }
+    std::vector<size_t> list_segments() const {
+        std::vector<size_t> list;
+        boost::system::error_code ec;
+        for (boost::filesystem::directory_iterator it(m_folder, ec), end; !ec && it != end; ++it) {
+            const std::string name = it->path().filename().string();
+            if (name.size() == 20 && name.compare(0, 8, "segment_") == 0 && it->path().extension() == ".bin") list.push_back(std::stoul(name.substr(8, 8)));
+        }
+        std::sort(list.begin(), list.end());
+        return list;
+    }
+    void next_segment() {
+        m_writer.close();
+        m_segment++;
+        m_size = 0;
+    }
+    std::mutex m_mtx;
+    boost::filesystem::path m_folder;
+    size_t m_segment = 0, m_size = 0;
+    std::ofstream m_writer;
+    std::map<size_t, std::unique_ptr<boost::iostreams::mapped_file_source>> m_maps;
+};
+PackedImageStore packed_store;
+
+// Same as store_image, into the packed store
+bool pack_image(const std::string& bytes, const std::string& key, const size_t width, const size_t height, const size_t components, const std::string& file_type) {
+    ImageBlob blob;
+    if (file_type == "jpg" && width <= max_image_dims && height <= max_image_dims && (components == 1 || components == 3)) {
+        if (!packed_store.append(key, bytes, blob)) return false;
+    }
+    else {
+        std::string output;
+        try {
+            dlib::array2d<dlib::rgb_pixel> img;
+            if (width > max_image_dims || height > max_image_dims) resize_image_fast(bytes, file_type, width, height, img);
+            else if (file_type == "jpg") dlib::load_jpeg(img, reinterpret_cast<const unsigned char*>(bytes.data()), bytes.size());
+            else dlib::load_png(img, reinterpret_cast<const unsigned char*>(bytes.data()), bytes.size());
+            if (!encode_jpeg(img, 90, output)) return false;
+        }
+        catch (std::exception& e) {
+            if (verbose) std::cerr << "Error processing image: " << key << " - " << e.what() << std::endl;
+            return false;
+        }
+        if (!packed_store.append(key, output, blob)) return false;
+    }
+    persister.add_blob(std::move(blob));
+    return true;
+}
+
+// 64-bit key of a cache file: the first 16 hex digits of its name, which is the SHA-256 of its content, or the hash of
+// its URL for the images stored before
+bool parse_image_key(const std::string& hex, uint64_t& key) {
+    if (hex.size() < 16) return false;
+    key = 0;
+    for (size_t i = 0; i < 16; ++i) {
+        const char ch = hex[i];
+        const int value = (ch >= '0' && ch <= '9') ? ch - '0' : ((ch >= 'a' && ch <= 'f') ? ch - 'a' + 10 : -1);
+        if (value < 0) return false;
+        key = (key << 4) | static_cast<uint64_t>(value);
+    }
+    return true;
+}
+uint64_t get_image_key(const std::string& url, const std::string& content_hash) {
+    uint64_t key = 0;
+    if (content_hash.size() == 64 && parse_image_key(content_hash, key)) return key;
+    return static_cast<uint64_t>(boost::hash<std::string>{}(url));
+}
+
+// Difference hash: each bit tells whether a cell of a 9x8 grayscale thumbnail is brighter than its right neighbour.
+// It is computed from a 1/8 scaled decode for the JPEG images
+bool compute_dhash(const std::string& bytes, const std::string& file_type, uint64_t& hash) {
+    std::vector<unsigned char> rgb;
+    size_t width = 0, height = 0;
+    dlib::array2d<dlib::rgb_pixel> img;
+    const unsigned char* pixels = nullptr;
+    if (file_type == "jpg" && decode_jpeg_scaled(bytes, 9, 8, rgb, width, height)) {
+        pixels = rgb.data();
+    }
+    else if (file_type == "png") {
+        try { dlib::load_png(img, reinterpret_cast<const unsigned char*>(bytes.data()), bytes.size()); }
+        catch (std::exception&) { return false; }
+        width = img.nc();
+        height = img.nr();
+        if (width > 0 && height > 0) pixels = reinterpret_cast<const unsigned char*>(&img[0][0]);
+    }
+    if (pixels == nullptr || width < 9 || height < 8) return false;
+    // Cells may cover a different number of pixels, compare their averages
+    double cells[8][9] = {}, counts[8][9] = {};
+    for (size_t y = 0; y < height; ++y) {
+        const size_t cy = y * 8 / height;
+        const unsigned char* row = pixels + y * width * 3;
+        for (size_t x = 0; x < width; ++x) {
+            cells[cy][x * 9 / width] += 0.299 * row[3 * x] + 0.587 * row[3 * x + 1] + 0.114 * row[3 * x + 2];
+            counts[cy][x * 9 / width] += 1.0;
+        }
+    }
+    hash = 0;
+    for (size_t y = 0; y < 8; ++y) {
+        for (size_t x = 0; x < 8; ++x) hash = (hash << 1) | (cells[y][x] / counts[y][x] > cells[y][x + 1] / counts[y][x + 1] ? 1 : 0);
+    }
+    return true;
+}
+
+// Contents stored during the session: SHA-256 of the downloaded bytes -> SHA-256 of the stored content it resolves to
+// (the same one, or the one of a near duplicate). Only the last recent_image_contents are kept, the others and those
+// of the previous sessions are found by their content_hash in queues.db
+class ContentIndex {
+public:
+    // Returns false with the stored key when the content is known, otherwise reserves it for the caller, who must then
+    // commit or remove it. A content reserved by another thread is waited for, and taken over if its store failed
+    bool reserve(const Sha256Digest& digest, Sha256Digest& key) {
+        std::unique_lock<std::mutex> lck(m_mtx);
+        while (true) {
+            auto it = m_contents.emplace(digest, Entry{ digest, true });
+            if (it.second) break;
+            if (!it.first->second.pending) {
+                key = it.first->second.key;
+                return false;
+            }
+            m_resolved.wait(lck);
+        }
+        lck.unlock();
+        key = digest;
+        if (!stored_on_disk(digest)) return true;
+        commit(digest);
+        return false;
+    }
+    // The reserved content is stored
+    void commit(const Sha256Digest& digest) {
+        std::lock_guard<std::mutex> lck(m_mtx);
+        auto it = m_contents.find(digest);
+        if (it != m_contents.end() && it->second.pending) {
+            it->second.pending = false;
+            add_recent(digest);
+        }
+        m_resolved.notify_all();
+    }
+    void set(const Sha256Digest& digest, const Sha256Digest& key) {
+        std::lock_guard<std::mutex> lck(m_mtx);
+        auto& entry = m_contents[digest];
+        if (entry.pending || entry.key != key) add_recent(digest);
+        entry = Entry{ key, false };
+        m_resolved.notify_all();
+    }
+    void remove(const Sha256Digest& digest) {
+        std::lock_guard<std::mutex> lck(m_mtx);
+        m_contents.erase(digest);
+        m_resolved.notify_all();
+    }
+
+private:
+    struct DigestHash {
+        size_t operator()(const Sha256Digest& digest) const {
+            size_t h;
+            std::memcpy(&h, digest.data(), sizeof(h));
+            return h;
+        }
+    };
+    struct Entry {
+        Sha256Digest key;
+        bool pending = true;
+    };
+    // Indexed lookup, through the read connection of the calling thread
+    static bool stored_on_disk(const Sha256Digest& digest) {
+        try {
+            return get_lookup_storage().count<ImageData>(where(c(&ImageData::content_hash) == to_hex(digest.data(), digest.size()) and c(&ImageData::file_size) > 0)) > 0;
+        }
+        catch (std::system_error&) {
+            return false;
+        }
+    }
+    // Forget the oldest resolved contents beyond the window. A content whose row is not written yet may be stored twice
+    void add_recent(const Sha256Digest& digest) {
+        m_recent.push_back(digest);
+        while (m_recent.size() > recent_image_contents) {
+            auto it = m_contents.find(m_recent.front());
+            if (it != m_contents.end() && !it->second.pending) m_contents.erase(it);
+            m_recent.pop_front();
+        }
+    }
+    std::mutex m_mtx;
+    std::condition_variable m_resolved;
+    std::unordered_map<Sha256Digest, Entry, DigestHash> m_contents;
+    std::deque<Sha256Digest> m_recent;
+};
+ContentIndex image_contents;
+
+// BK-trees of the perceptual hashes of the recently stored images, searched with the Hamming distance. When the current
+// tree holds recent_image_hashes images, the previous one is dropped and a new one starts, so the near duplicates are
+// only found among the last 1 to 2 x recent_image_hashes images
+class PerceptualIndex {
+public:
+    void insert(const uint64_t hash, const Sha256Digest& key) {
+        if (!is_usable(hash)) return;
+        std::lock_guard<std::mutex> lck(m_mtx);
+        if (m_trees[m_current].size() >= recent_image_hashes) {
+            m_current = 1 - m_current;
+            std::vector<Node>().swap(m_trees[m_current]);
+        }
+        std::vector<Node>& nodes = m_trees[m_current];
+        if (nodes.empty()) {
+            nodes.push_back(Node{ hash, key, {} });
+            return;
+        }
+        uint32_t index = 0;
+        while (true) {
+            const uint8_t distance = hamming(nodes[index].hash, hash);
+            if (distance == 0) return;
+            auto child = std::find_if(nodes[index].children.begin(), nodes[index].children.end(), [distance](const std::pair<uint8_t, uint32_t>& c) { return c.first == distance; });
+            if (child == nodes[index].children.end()) {
+                nodes[index].children.emplace_back(distance, static_cast<uint32_t>(nodes.size()));
+                nodes.push_back(Node{ hash, key, {} });
+                return;
+            }
+            index = child->second;
+        }
+    }
+    // Key of the closest stored image within max_distance
+    bool find(const uint64_t hash, const size_t max_distance, Sha256Digest& key) {
+        if (!is_usable(hash)) return false;
+        std::lock_guard<std::mutex> lck(m_mtx);
+        size_t best = max_distance + 1;
+        for (auto& nodes : m_trees) {
+            if (nodes.empty()) continue;
+            std::vector<uint32_t> stack{ 0 };
+            while (!stack.empty()) {
+                const Node& node = nodes[stack.back()];
+                stack.pop_back();
+                const size_t distance = hamming(node.hash, hash);
+                if (distance < best) {
+                    best = distance;
+                    key = node.key;
+                }
+                for (auto& child : node.children) {
+                    if (child.first + max_distance >= distance && child.first <= distance + max_distance) stack.push_back(child.second);
+                }
+            }
+        }
+        return best <= max_distance;
+    }
+    size_t size() {
+        std::lock_guard<std::mutex> lck(m_mtx);
+        return m_trees[0].size() + m_trees[1].size();
+    }
+
+private:
+    struct Node {
+        uint64_t hash;
+        Sha256Digest key;
+        std::vector<std::pair<uint8_t, uint32_t>> children;
+    };
+    static uint8_t hamming(const uint64_t a, const uint64_t b) { return static_cast<uint8_t>(std::bitset<64>(a ^ b).count()); }
+    // Flat images (almost all bits equal) would match each other without looking alike
+    static bool is_usable(const uint64_t hash) {
+        const size_t bits = std::bitset<64>(hash).count();
+        return bits >= 4 && bits <= 60;
+    }
+    std::mutex m_mtx;
+    std::vector<Node> m_trees[2];
+    size_t m_current = 0;
+};
+PerceptualIndex perceptual_index;
+
+// SimHash of the visible text of a page, built from its 3-word shingles while the page is walked
+class SimHash {
+public:
+    void clear() {
+        std::fill(std::begin(m_weights), std::end(m_weights), 0);
+        m_words[0] = m_words[1] = 0;
+        m_num_words = m_features = 0;
+    }
+    // Words are ASCII letters and digits (lower cased) and UTF-8 sequences, a text always ends the current word
+    void add_text(const char* p, const char* end) {
+        uint64_t word = 0xcbf29ce484222325ULL;
+        bool in_word = false;
+        for (; p < end; ++p) {
+            const unsigned char ch = static_cast<unsigned char>(*p);
+            if ((ch >= '0' && ch <= '9') || (ch >= 'a' && ch <= 'z') || ch >= 0x80 || (ch >= 'A' && ch <= 'Z')) {
+                word ^= (ch >= 'A' && ch <= 'Z') ? ch + 32 : ch;
+                word *= 0x100000001b3ULL;
+                in_word = true;
+            }
+            else if (in_word) {
+                add_word(word);
+                word = 0xcbf29ce484222325ULL;
+                in_word = false;
+            }
+        }
+        if (in_word) add_word(word);
+    }
+    void add_text(const char* text) {
+        if (text != nullptr) add_text(text, text + std::strlen(text));
+    }
+    // 0 when the page has too little text to be compared with others
+    uint64_t value() const {
+        if (m_features < min_simhash_features) return 0;
+        uint64_t hash = 0;
+        for (int i = 0; i < 64; ++i) if (m_weights[i] > 0) hash |= 1ULL << i;
+        return hash;
+    }
+
+private:
+    void add_word(const uint64_t word) {
+        if (++m_num_words >= 3) {
+            // splitmix64 finalizer of the shingle, so that its bits are independent
+            uint64_t h = (m_words[0] * 0x9e3779b97f4a7c15ULL + m_words[1]) * 0x9e3779b97f4a7c15ULL + word;
+            h = (h ^ (h >> 30)) * 0xbf58476d1ce4e5b9ULL;
+            h = (h ^ (h >> 27)) * 0x94d049bb133111ebULL;
+            h ^= h >> 31;
+            for (int i = 0; i < 64; ++i) m_weights[i] += ((h >> i) & 1) ? 1 : -1;
+            m_features++;
+        }
+        m_words[0] = m_words[1];
+        m_words[1] = word;
+    }
+    int32_t m_weights[64] = {};
+    uint64_t m_words[2] = {};
+    size_t m_num_words = 0, m_features = 0;
+};
+
+// Fingerprints of the recently parsed pages, in a ring buffer. Two fingerprints within near_duplicate_page_distance
+// bits share at least one of their four 16-bit blocks, so a lookup only compares the entries of four buckets
+class SimHashIndex {
+public:
+    static_assert(near_duplicate_page_distance < 4, "Each block must be able to hold an exact match");
+    explicit SimHashIndex(size_t capacity) : m_capacity(capacity) {}
+    // True when a page of another URL with a close fingerprint was seen recently, otherwise the page is remembered
+    bool check_and_insert(const uint64_t fingerprint, const uint64_t url_id) {
+        std::lock_guard<std::mutex> lck(m_mtx);
+        if (m_buckets.empty()) {
+            m_buckets.resize(4 * 65536);
+            m_entries.reserve(m_capacity);
+        }
+        for (int b = 0; b < 4; ++b) {
+            for (const uint32_t slot : m_buckets[bucket(b, fingerprint)]) {
+                const Entry& entry = m_entries[slot];
+                if (entry.url_id != url_id && std::bitset<64>(entry.fingerprint ^ fingerprint).count() <= near_duplicate_page_distance) return true;
+            }
+        }
+        uint32_t slot = static_cast<uint32_t>(m_next);
+        if (m_entries.size() < m_capacity) {
+            m_entries.push_back(Entry{ fingerprint, url_id });
+        }
+        else { // Forget the oldest page
+            for (int b = 0; b < 4; ++b) {
+                std::vector<uint32_t>& slots = m_buckets[bucket(b, m_entries[slot].fingerprint)];
+                auto it = std::find(slots.begin(), slots.end(), slot);
+                if (it != slots.end()) {
+                    *it = slots.back();
+                    slots.pop_back();
+                }
+            }
+            m_entries[slot] = Entry{ fingerprint, url_id };
+        }
+        for (int b = 0; b < 4; ++b) m_buckets[bucket(b, fingerprint)].push_back(slot);
+        m_next = (m_next + 1) % m_capacity;
+        return false;
+    }
+
+private:
+    struct Entry {
+        uint64_t fingerprint, url_id;
+    };
+    static size_t bucket(const int block, const uint64_t fingerprint) { return block * 65536 + ((fingerprint >> (16 * block)) & 0xFFFF); }
+    std::mutex m_mtx;
+    size_t m_capacity, m_next = 0;
+    std::vector<Entry> m_entries;
+    std::vector<std::vector<uint32_t>> m_buckets;
+};
+SimHashIndex page_fingerprints(recent_page_fingerprints);
+
+// Everything gathered from a page in a single walk of its tree. Each spider thread reuses its own instance
+// so that the buffers keep their capacity from one page to the next
+struct PageExtract {
+    struct Image {
+        std::string url, alt, surrounding;
+    };
+    std::vector<std::string> links;
+    std::vector<Image> images;
+    std::string title, h1;
+    SimHash simhash;
+    std::vector<const GumboNode*> nodes;
+    void clear() {
+        links.clear();
+        images.clear();
+        title.clear();
+        h1.clear();
+        simhash.clear();
+        nodes.clear();
+    }
+};
+
+const char* get_first_child_text(const GumboNode* node) {
+    const GumboVector& children = node->v.element.children;
+    if (children.length == 0) return nullptr;
+    const GumboNode* child = static_cast<const GumboNode*>(children.data[0]);
+    return (child != nullptr && child->type == GUMBO_NODE_TEXT) ? child->v.text.text : nullptr;
+}
+
+// Text nodes right before and after an image, within its parent element
+void get_surrounding_text(const GumboNode* node, std::string& surrounding) {
+    const GumboNode* parent = node->parent;
+    if (parent == nullptr || parent->type != GUMBO_NODE_ELEMENT) return;
+    const GumboVector& children = parent->v.element.children;
+    const int index = static_cast<int>(node->index_within_parent);
+    for (int j = index - 1; j >= 0; --j) {
+        const GumboNode* sibling = static_cast<const GumboNode*>(children.data[j]);
+        if (sibling != nullptr && sibling->type == GUMBO_NODE_TEXT && sibling->v.text.text != nullptr) {
+            surrounding = sibling->v.text.text;
+            break;
+        }
+    }
+    for (int j = index + 1; j < static_cast<int>(children.length); ++j) {
+        const GumboNode* sibling = static_cast<const GumboNode*>(children.data[j]);
+        if (sibling != nullptr && sibling->type == GUMBO_NODE_TEXT && sibling->v.text.text != nullptr) {
+            if (!surrounding.empty()) surrounding += ' ';
+            surrounding += sibling->v.text.text;
+            break;
+        }
+    }
+}
+
+// The texts of the images are normalized once the title is known
+void normalize_image_texts(PageExtract& page) {
+    const std::string& title = page.title.empty() ? page.h1 : page.title;
+    for (auto& image : page.images) {
+        if (!image.alt.empty()) remove_stop_words(image.alt);
+        if (!title.empty()) image.surrounding = title + " " + image.surrounding;
+        if (!image.surrounding.empty()) remove_stop_words(image.surrounding);
+    }
+}
+
+// Walk the page tree once, in document order, collecting the links, the images with their texts, the title and the first h1
+void extract_page(const GumboNode* root_node, const std::string& base_url, const bool with_links, PageExtract& page) {
+    page.clear();
+    page.nodes.push_back(root_node);
+    while (!page.nodes.empty()) {
+        const GumboNode* node = page.nodes.back();
+        page.nodes.pop_back();
+        if (node != nullptr && node->type == GUMBO_NODE_TEXT && node->parent != nullptr && node->parent->type == GUMBO_NODE_ELEMENT) {
+            const GumboTag parent_tag = node->parent->v.element.tag;
+            if (parent_tag != GUMBO_TAG_SCRIPT && parent_tag != GUMBO_TAG_STYLE && parent_tag != GUMBO_TAG_TEXTAREA) page.simhash.add_text(node->v.text.text);
+        }
+        if (node == nullptr || node->type != GUMBO_NODE_ELEMENT) continue;
+        const GumboElement& element = node->v.element;
+        switch (element.tag) {
+        case GUMBO_TAG_A:
+            if (with_links) {
+                GumboAttribute* href = gumbo_get_attribute(&element.attributes, "href");
+                if (href != nullptr) {
+                    std::string link = href->value;
+                    boost::algorithm::trim(link);
+                    if (!link.empty()) {
+                        std::string abs_url = get_abs_url(link, base_url, false);
+                        if (!abs_url.empty()) page.links.push_back(std::move(abs_url));
+                    }
+                }
+            }
+            break;
+        case GUMBO_TAG_IMG: {
+            GumboAttribute* src_attr = gumbo_get_attribute(&element.attributes, "src");
+            if (src_attr != nullptr) {
+                std::string src_url = get_abs_url(src_attr->value, base_url, true);
+                if (src_url.find("http") == 0) { // Check if absolute URL
+                    GumboAttribute* alt_attr = gumbo_get_attribute(&element.attributes, "alt");
+                    page.images.push_back(PageExtract::Image{ std::move(src_url), alt_attr ? alt_attr->value : "", "" });
+                    get_surrounding_text(node, page.images.back().surrounding);
+                }
+            }
+            break;
+        }
+        case GUMBO_TAG_TITLE:
+            if (page.title.empty() && node->parent != nullptr && node->parent->type == GUMBO_NODE_ELEMENT && node->parent->v.element.tag == GUMBO_TAG_HEAD) {
+                const char* text = get_first_child_text(node);
+                if (text != nullptr) page.title = text;
+            }
+            break;
+        case GUMBO_TAG_H1:
+            if (page.h1.empty()) {
+                const char* text = get_first_child_text(node);
+                if (text != nullptr) page.h1 = text;
+            }
+            break;
+        default:
+            break;
+        }
+        // Children are stacked in reverse order to be visited in document order
+        for (unsigned int i = element.children.length; i > 0; --i) {
+            page.nodes.push_back(static_cast<const GumboNode*>(element.children.data[i - 1]));
+        }
+    }
+
+    normalize_image_texts(page);
+}
+
+// Streaming extraction: the raw page is scanned once for the few elements the spider needs, without building any tree.
+// The open elements are tracked only to find the text siblings of the images, as the Gumbo walk does
+inline const char* find_byte(const char* p, const char* end, const char ch) {
+#if defined(__SSE2__) || defined(_M_X64)
+    const __m128i needle = _mm_set1_epi8(ch);
+    while (end - p >= 16) {
+        if (_mm_movemask_epi8(_mm_cmpeq_epi8(_mm_loadu_si128(reinterpret_cast<const __m128i*>(p)), needle)) != 0) break;
+        p += 16;
+    }
+#endif
+    while (p < end && *p != ch) ++p;
+    return p;
+}
+inline bool is_html_space(const char ch) {
+    return ch == ' ' || ch == '\t' || ch == '\n' || ch == '\r' || ch == '\f';
+}
+inline char to_lower_ascii(const char ch) {
+    return (ch >= 'A' && ch <= 'Z') ? ch + 32 : ch;
+}
+inline bool is_blank(const char* p, const char* end) {
+    for (; p < end; ++p) if (!is_html_space(*p)) return false;
+    return true;
+}
+
+// Append a text or an attribute value with its character references decoded and its line breaks normalized
+void append_html_text(std::string& out, const char* p, const char* end) {
+    while (p < end) {
+        const char ch = *p;
+        if (ch == '&') {
+            const char* semi = p + 1;
+            while (semi < end && semi - p < 10 && *semi != ';') ++semi;
+            uint32_t cp = 0xFFFFFFFF;
+            if (semi < end && *semi == ';') {
+                const std::string_view name(p + 1, semi - p - 1);
+                if (name.size() > 1 && name[0] == '#') {
+                    const bool hex = name[1] == 'x' || name[1] == 'X';
+                    cp = 0;
+                    for (size_t i = hex ? 2 : 1; i < name.size(); ++i) {
+                        const char d = to_lower_ascii(name[i]);
+                        if (d >= '0' && d <= '9') cp = cp * (hex ? 16 : 10) + (d - '0');
+                        else if (hex && d >= 'a' && d <= 'f') cp = cp * 16 + (d - 'a' + 10);
+                        else {
+                            cp = 0xFFFFFFFF;
+                            break;
+                        }
+                    }
+                    if (cp == 0 || (cp > 0x10FFFF && cp != 0xFFFFFFFF) || (cp >= 0xD800 && cp <= 0xDFFF)) cp = 0xFFFD;
+                }
+                else if (name == "amp") cp = '&';
+                else if (name == "lt") cp = '<';
+                else if (name == "gt") cp = '>';
+                else if (name == "quot") cp = '"';
+                else if (name == "apos") cp = '\'';
+                else if (name == "nbsp") cp = 0xA0;
+            }
+            if (cp != 0xFFFFFFFF) {
+                append_utf8(out, cp);
+                p = semi + 1;
+                continue;
+            }
+        }
+        else if (ch == '\r') {
+            out += '\n';
+            p += (p + 1 < end && p[1] == '\n') ? 2 : 1;
+            continue;
+        }
+        out += ch;
+        ++p;
+    }
+}
+
+// Lower case name of a tag or an attribute
+const char* read_html_name(const char* p, const char* end, std::string& name) {
+    name.clear();
+    while (p < end && !is_html_space(*p) && *p != '/' && *p != '>' && (name.empty() || *p != '=')) name += to_lower_ascii(*p++);
+    return p;
+}
+
+// Start of the end tag of a raw text element (script, style...)
+const char* find_end_tag(const char* p, const char* end, const std::string& name) {
+    while ((p = find_byte(p, end, '<')) < end) {
+        if (static_cast<size_t>(end - p) > name.size() + 2 && p[1] == '/') {
+            size_t i = 0;
+            while (i < name.size() && to_lower_ascii(p[2 + i]) == name[i]) ++i;
+            const char next = p[2 + i];
+            if (i == name.size() && (is_html_space(next) || next == '>' || next == '/')) return p;
+        }
+        ++p;
+    }
+    return end;
+}
+
+template <size_t N>
+bool is_one_of(const std::string& name, const std::array<std::string_view, N>& names) {
+    return std::find(names.begin(), names.end(), name) != names.end();
+}
+constexpr std::array<std::string_view, 15> void_tags = { "area", "base", "br", "col", "embed", "hr", "img", "input", "keygen", "link", "meta", "param", "source", "track", "wbr" };
+constexpr std::array<std::string_view, 8> raw_text_tags = { "script", "style", "textarea", "xmp", "iframe", "noembed", "noframes", "plaintext" };
+constexpr std::array<std::string_view, 8> head_tags = { "html", "head", "title", "meta", "link", "base", "style", "script" };
+constexpr std::array<std::string_view, 9> self_closed_tags = { "p", "li", "dt", "dd", "option", "tr", "td", "th", "a" };
+constexpr std::array<std::string_view, 27> paragraph_closing_tags = { "address", "article", "aside", "blockquote", "dd", "div", "dl", "dt", "fieldset", "figure", "footer", "form",
+    "h1", "h2", "h3", "h4", "h5", "h6", "header", "hr", "li", "main", "nav", "ol", "pre", "section", "table" };
+
+struct ScanLevel {
+    std::string name;
+    const char* text_begin;
+    const char* text_end;
+};
+
+void extract_page_stream(const std::string& html, const std::string& base_url, const bool with_links, PageExtract& page) {
+    thread_local std::vector<ScanLevel> levels;
+    thread_local std::vector<std::pair<size_t, size_t>> pending; // Images waiting for their next text sibling: level and image index
+    thread_local std::string name, attr_name, value;
+    page.clear();
+    levels.clear();
+    pending.clear();
+    levels.push_back(ScanLevel{ "", nullptr, nullptr });
+    bool in_body = false, h1_pending = false;
+
+    auto on_text = [&](const char* begin, const char* end) {
+        if (begin >= end) return;
+        const bool blank = is_blank(begin, end);
+        if (h1_pending) {
+            if (!blank) append_html_text(page.h1, begin, end);
+            h1_pending = false;
+        }
+        if (blank) return;
+        page.simhash.add_text(begin, end);
+        ScanLevel& level = levels.back();
+        level.text_begin = begin;
+        level.text_end = end;
+        for (size_t i = 0; i < pending.size();) {
+            if (pending[i].first == levels.size() - 1) {
+                std::string& surrounding = page.images[pending[i].second].surrounding;
+                if (!surrounding.empty()) surrounding += ' ';
+                append_html_text(surrounding, begin, end);
+                pending[i] = pending.back();
+                pending.pop_back();
+            }
+            else ++i;
+        }
+    };
+    auto pop_level = [&]() {
+        levels.pop_back();
+        pending.erase(std::remove_if(pending.begin(), pending.end(), [&](const std::pair<size_t, size_t>& entry) { return entry.first >= levels.size(); }), pending.end());
+    };
+
+    const char* p = html.data(), * end = p + html.size(), * text = p;
+    while (true) {
+        const char* lt = find_byte(p, end, '<');
+        if (end - lt < 2) break;
+        const char next = lt[1];
+        if (next == '!' || next == '?') { // Comment, doctype or processing instruction
+            on_text(text, lt);
+            h1_pending = false;
+            const char* close = nullptr;
+            if (end - lt >= 4 && lt[2] == '-' && lt[3] == '-') {
+                for (close = lt + 4; (close = find_byte(close, end, '>')) < end; ++close) {
+                    if (close[-1] == '-' && close[-2] == '-' && close - lt >= 6) break;
+                }
+            }
+            else {
+                close = find_byte(lt, end, '>');
+            }
+            p = text = (close < end ? close + 1 : end);
+            continue;
+        }
+        const bool closing = next == '/';
+        const char* q = lt + (closing ? 2 : 1);
+        if (q >= end || !((*q >= 'a' && *q <= 'z') || (*q >= 'A' && *q <= 'Z'))) { // Not a tag, the '<' belongs to the text
+            p = lt + 1;
+            continue;
+        }
+        on_text(text, lt);
+        h1_pending = false;
+
+        // Read the tag and the attributes the spider needs
+        q = read_html_name(q, end, name);
+        const char* href = nullptr, * href_end = nullptr, * src = nullptr, * src_end = nullptr, * alt = nullptr, * alt_end = nullptr;
+        bool self_closing = false;
+        while (q < end && *q != '>') {
+            if (is_html_space(*q) || *q == '/') {
+                self_closing = *q++ == '/';
+                continue;
+            }
+            self_closing = false;
+            q = read_html_name(q, end, attr_name);
+            while (q < end && is_html_space(*q)) ++q;
+            const char* value_begin = q, * value_end = q;
+            if (q < end && *q == '=') {
+                ++q;
+                while (q < end && is_html_space(*q)) ++q;
+                if (q < end && (*q == '"' || *q == '\'')) {
+                    const char quote = *q++;
+                    value_begin = q;
+                    q = value_end = find_byte(q, end, quote);
+                    if (q < end) ++q;
+                }
+                else {
+                    value_begin = q;
+                    while (q < end && !is_html_space(*q) && *q != '>') ++q;
+                    value_end = q;
+                }
+            }
+            if (attr_name == "href" && href == nullptr) { href = value_begin; href_end = value_end; }
+            else if (attr_name == "src" && src == nullptr) { src = value_begin; src_end = value_end; }
+            else if (attr_name == "alt" && alt == nullptr) { alt = value_begin; alt_end = value_end; }
+        }
+        if (q >= end) break; // The last tag of the page is truncated
+        p = text = q + 1;
+
+        if (closing) {
+            if (name == "body" || name == "html") continue;
+            for (size_t i = levels.size() - 1; i > 0; --i) {
+                if (levels[i].name == name) {
+                    while (levels.size() > i) pop_level();
+                    break;
+                }
+            }
+            continue;
+        }
+
+        // Elements closed by the start of another one
+        while (levels.size() > 1) {
+            const std::string& top = levels.back().name;
+            if ((top == name && is_one_of(name, self_closed_tags)) || (top == "p" && is_one_of(name, paragraph_closing_tags)) ||
+                ((top == "td" || top == "th") && (name == "td" || name == "th" || name == "tr")) || ((top == "dt" || top == "dd") && (name == "dt" || name == "dd"))) {
+                pop_level();
+            }
+            else break;
+        }
+        if (!in_body && !is_one_of(name, head_tags)) in_body = true;
+
+        if (name == "a") {
+            if (with_links && href != nullptr) {
+                value.clear();
+                append_html_text(value, href, href_end);
+                boost::algorithm::trim(value);
+                if (!value.empty()) {
+                    std::string abs_url = get_abs_url(value, base_url, false);
+                    if (!abs_url.empty()) page.links.push_back(std::move(abs_url));
+                }
+            }
+        }
+        else if (name == "img") {
+            if (src != nullptr) {
+                value.clear();
+                append_html_text(value, src, src_end);
+                std::string src_url = get_abs_url(value, base_url, true);
+                if (src_url.find("http") == 0) { // Check if absolute URL
+                    page.images.push_back(PageExtract::Image{ std::move(src_url), "", "" });
+                    PageExtract::Image& image = page.images.back();
+                    if (alt != nullptr) append_html_text(image.alt, alt, alt_end);
+                    if (levels.back().text_begin != nullptr) append_html_text(image.surrounding, levels.back().text_begin, levels.back().text_end);
+                    pending.emplace_back(levels.size() - 1, page.images.size() - 1);
+                }
+            }
+            continue;
+        }
+        else if (name == "title") {
+            const char* close = find_end_tag(p, end, name);
+            if (page.title.empty() && !in_body && !is_blank(p, close)) append_html_text(page.title, p, close);
+            page.simhash.add_text(p, close);
+            p = text = close;
+            continue;
+        }
+        else if (is_one_of(name, raw_text_tags)) {
+            p = text = find_end_tag(p, end, name);
+            continue;
+        }
+        if (is_one_of(name, void_tags)) continue;
+        if ((name == "html" || name == "head" || name == "body") && std::any_of(levels.begin(), levels.end(), [&](const ScanLevel& level) { return level.name == name; })) continue;
+        if (self_closing && std::any_of(levels.begin(), levels.end(), [](const ScanLevel& level) { return level.name == "svg" || level.name == "math"; })) continue;
+        levels.push_back(ScanLevel{ name, nullptr, nullptr });
+        if (name == "h1" && page.h1.empty()) h1_pending = true;
+    }
+    on_text(text, end);
+    normalize_image_texts(page);
+}
+
+// The URLs hit in a seen filter are looked up by batches in the in-memory database, then in the disk-based one.
+// Those found nowhere are false positives, thus new, unless they were dropped after a failure
+template <class T>
+void confirm_known(std::vector<std::string>& maybe_known, SeenSet& dropped, std::vector<std::string>& known, std::vector<std::string>& unknown) {
+    if (maybe_known.empty()) return;
+    const size_t max_bound_urls = 500;
+    std::unordered_set<std::string> found;
+    for (size_t i = 0; i < maybe_known.size(); i += max_bound_urls) {
+        std::vector<std::string> bound_urls(maybe_known.begin() + i, maybe_known.begin() + std::min(i + max_bound_urls, maybe_known.size()));
+        std::unique_lock<DbMutex> lck(mtx);
+        auto rows = memory_storage.select(&T::url, where(in(&T::url, bound_urls)));
+        lck.unlock();
+        found.insert(rows.begin(), rows.end());
+        bound_urls.erase(std::remove_if(bound_urls.begin(), bound_urls.end(), [&found](const std::string& url) { return found.count(url) != 0; }), bound_urls.end());
+        if (bound_urls.empty()) continue;
+        rows = get_lookup_storage().select(&T::url, where(in(&T::url, bound_urls)));
+        found.insert(rows.begin(), rows.end());
+    }
+    for (auto& url : maybe_known) {
+        if (found.count(url) != 0) known.push_back(std::move(url));
+        else if (!dropped.contains(url_fingerprint(url))) unknown.push_back(std::move(url));
+    }
+}
+
+// Publish all the links of a page at once
+void publish_links(const PageExtract& page) {
+    std::vector<std::string> new_urls, known_urls, maybe_known;
+    std::unordered_set<std::string_view> page_urls; // A link repeated in the page is published once
+    for (auto& abs_url : page.links) {
+        if (!page_urls.insert(abs_url).second) continue;
+        if (seen_urls.insert(url_fingerprint(abs_url))) new_urls.push_back(abs_url);
+        else maybe_known.push_back(abs_url);
+    }
+    confirm_known<UrlData>(maybe_known, dropped_urls, known_urls, new_urls);
+    if (new_urls.empty() && known_urls.empty()) return;
+
+    const size_t max_bound_urls = 500;
+    std::vector<std::string> inserted_urls;
+    std::string last_crawled(""), last_seen = get_current_time();
+    std::unique_lock<DbMutex> lck(mtx);
+    try {
+        memory_storage.transaction([&]() mutable {
+            for (auto& abs_url : new_urls) {
+                UrlData data{ abs_url, std::make_unique<std::string>(last_crawled), last_seen, 100 };
+                try { memory_storage.insert(data); } // Fails when another page published the same URL meanwhile
+                catch (std::system_error&) { continue; }
+                inserted_urls.push_back(abs_url);
+                if (verbose) std::cout << "url: " << abs_url << " - last_seen: " << last_seen << std::endl;
+            }
+            for (size_t i = 0; i < known_urls.size(); i += max_bound_urls) {
+                std::vector<std::string> bound_urls(known_urls.begin() + i, known_urls.begin() + std::min(i + max_bound_urls, known_urls.size()));
+                memory_storage.update_all(set(c(&UrlData::last_seen) = last_seen), where(in(&UrlData::url, bound_urls)));
+            }
+            return true;
+            });
+    }
+    catch (std::system_error& e) {
+        if (verbose) std::cout << e.what() << std::endl;
+    }
+    catch (...) {
+        if (verbose) std::cout << "unknown exeption" << std::endl;
+    }
+    lck.unlock();
+    persister.mark_urls(inserted_urls);
+    persister.touch_urls(known_urls, last_seen);
+    std::vector<std::string> spilled_urls;
+    for (auto& url : inserted_urls) if (frontier.push(url)) spilled_urls.push_back(url);
+    persister.spill_urls(spilled_urls);
+}
+
+// Publish all the images of a page at once, the new ones are returned to be downloaded
+void publish_images(const PageExtract& page, const std::string& base_url, std::vector<std::string>& new_images) {
+    std::vector<const PageExtract::Image*> candidates;
+    std::vector<std::string> known_images, maybe_known, unknown_images;
+    std::unordered_set<std::string_view> page_urls; // First occurrence of an image repeated in the page
+    for (auto& image : page.images) {
+        if (!page_urls.insert(image.url).second) continue;
+        if (seen_images.insert(url_fingerprint(image.url))) candidates.push_back(&image);
+        else maybe_known.push_back(image.url);
+    }
+    confirm_known<ImageData>(maybe_known, dropped_images, known_images, unknown_images);
+    for (auto& url : unknown_images) {
+        auto it = std::find_if(page.images.begin(), page.images.end(), [&url](const PageExtract::Image& image) { return image.url == url; });
+        if (it != page.images.end()) candidates.push_back(&*it);
+    }
+    if (candidates.empty() && known_images.empty()) return;
+
+    const size_t max_bound_urls = 500;
+    std::string mime(""), last_seen = get_current_time();
+    std::vector<const PageExtract::Image*> retexted;
+    std::unique_lock<DbMutex> lck(mtx);
+    try {
+        memory_storage.transaction([&]() mutable {
+            for (auto image : candidates) {
+                ImageData data{ image->url, std::make_unique<std::string>(image->alt), base_url, std::make_unique<std::string>(image->surrounding), 0, 0, 0, std::make_unique<std::string>(mime), last_seen };
+                try { memory_storage.insert(data); }
+                catch (std::system_error& e) {
+                    if (verbose) std::cout << e.what() << std::endl;
+                    known_images.push_back(image->url);
+                    continue;
+                }
+                new_images.push_back(image->url); // Only download image if not already present into the database
+                total_images++;
+                if (verbose) std::cout << "url: " << image->url << " - src: " << base_url << " - alt: " << image->alt << " - surrounding: " << image->surrounding << " - last_seen: " << last_seen << std::endl;
+            }
+            for (size_t i = 0; i < known_images.size(); i += max_bound_urls) {
+                std::vector<std::string> bound_urls(known_images.begin() + i, known_images.begin() + std::min(i + max_bound_urls, known_images.size()));
+                memory_storage.update_all(set(c(&ImageData::last_seen) = last_seen), where(in(&ImageData::url, bound_urls)));
+            }
+            // A replayed page is extracted with the current rules, the texts of its known images are refreshed
+            if (replaying && !known_images.empty()) {
+                const std::unordered_set<std::string> known(known_images.begin(), known_images.end());
+                for (auto& image : page.images) {
+                    if (known.count(image.url) == 0) continue;
+                    memory_storage.update_all(set(c(&ImageData::alt) = std::make_unique<std::string>(image.alt), c(&ImageData::surrounding_text) = std::make_unique<std::string>(image.surrounding)),
+                        where(c(&ImageData::url) == image.url));
+                    retexted.push_back(&image);
+                }
+            }
+            return true;
+            });
+    }
+    catch (std::system_error& e) {
+        if (verbose) std::cout << e.what() << std::endl;
+    }
+    catch (...) {
+        if (verbose) std::cout << "unknown exeption" << std::endl;
+    }
+    lck.unlock();
+    persister.mark_images(new_images);
+    persister.touch_images(known_images, last_seen);
+    for (auto image : retexted) persister.retext_image(image->url, image->alt, image->surrounding);
+}
+
+// Downloaded pages or images waiting to be processed
+struct FetchResult {
+    std::string url;
+    std::string body;
+    std::string etag;
+    std::string last_modified;
+    std::string content_type; // Only kept for the archive
+};
+std::string get_content_type(CURL* easy) {
+    char* content_type = nullptr;
+    curl_easy_getinfo(easy, CURLINFO_CONTENT_TYPE, &content_type);
+    return content_type == nullptr ? "" : content_type;
+}
+
+// Archive of the fetched responses as WARC files, with one gzip member per record so that a file can be read from any
+// record. The records are compressed by a thread of its own into a large buffer written sequentially, a new segment
+// starting past warc_segment_size. The HTTP headers of the records are rebuilt from what the spider keeps of the responses
+class WarcWriter {
+public:
+    bool open(const boost::filesystem::path& folder) {
+        boost::system::error_code ec;
+        boost::filesystem::create_directories(folder, ec);
+        if (!boost::filesystem::is_directory(folder)) return false;
+        if (deflateInit2(&m_zs, Z_DEFAULT_COMPRESSION, Z_DEFLATED, 15 + 16, 8, Z_DEFAULT_STRATEGY) != Z_OK) return false;
+        m_folder = folder;
+        m_enabled = true;
+        m_thread = std::thread(&WarcWriter::run, this);
+        return true;
+    }
+    bool enabled() const { return m_enabled; }
+    // Blocks while too many bytes are waiting to be written
+    void write(FetchResult&& response) {
+        std::string date = get_warc_date();
+        std::unique_lock<std::mutex> lck(m_mtx);
+        m_not_full.wait(lck, [this] { return m_pending_bytes < warc_queue_size || m_closed; });
+        if (m_closed) return;
+        m_pending_bytes += response.body.size();
+        m_records.push_back(Record{ std::move(date), std::move(response) });
+        m_not_empty.notify_one();
+    }
+    // Write the remaining records and close the current segment
+    void close() {
+        if (!m_enabled) return;
+        std::unique_lock<std::mutex> lck(m_mtx);
+        m_closed = true;
+        m_not_empty.notify_all();
+        m_not_full.notify_all();
+        lck.unlock();
+        m_thread.join();
+        deflateEnd(&m_zs);
+        m_enabled = false;
+    }
+    size_t written() const { return m_written; }
+    size_t segments() const { return m_segment; }
+
+private:
+    struct Record {
+        std::string date;
+        FetchResult response;
+    };
+    void run() {
+        std::deque<Record> records;
+        while (true) {
+            std::unique_lock<std::mutex> lck(m_mtx);
+            m_not_empty.wait(lck, [this] { return !m_records.empty() || m_closed; });
+            if (m_records.empty()) break; // Closed and drained
+            records.swap(m_records);
+            lck.unlock();
+            size_t bytes = 0;
+            for (auto& record : records) {
+                bytes += record.response.body.size();
+                append(record);
+            }
+            records.clear();
+            lck.lock();
+            m_pending_bytes -= bytes;
+            m_not_full.notify_all();
+        }
+        flush_buffer();
+        m_file.close();
+    }
+    void append(const Record& record) {
+        const FetchResult& response = record.response;
+        std::string http = "HTTP/1.1 200 OK\r\n";
+        if (!response.content_type.empty()) http += "Content-Type: " + response.content_type + "\r\n";
+        http += "Content-Length: " + std::to_string(response.body.size()) + "\r\n";
+        if (!response.etag.empty()) http += "ETag: " + response.etag + "\r\n";
+        if (!response.last_modified.empty()) http += "Last-Modified: " + response.last_modified + "\r\n";
+        http += "\r\n";
+        if (!m_file.is_open()) start_segment();
+        compress("WARC/1.0\r\nWARC-Type: response\r\nWARC-Record-ID: " + get_record_id() + "\r\nWARC-Date: " + record.date + "\r\nWARC-Target-URI: " + response.url +
+            "\r\nContent-Type: application/http; msgtype=response\r\nContent-Length: " + std::to_string(http.size() + response.body.size()) + "\r\n\r\n" + http, response.body);
+        m_written++;
+        if (m_buffer.size() >= warc_buffer_size) flush_buffer();
+        if (m_segment_bytes + m_buffer.size() >= warc_segment_size) {
+            flush_buffer();
+            m_file.close();
+        }
+    }
+    // Each segment starts with a warcinfo record
+    void start_segment() {
+        std::string date = get_warc_date(), timestamp;
+        for (char ch : date) if (isdigit(static_cast<unsigned char>(ch))) timestamp += ch;
+        char serial[16];
+        snprintf(serial, sizeof(serial), "%05zu", m_segment++);
+        const std::string filename = "FFspider-" + timestamp + "-" + serial + ".warc.gz";
+        m_file.open((m_folder / filename).string(), std::ios::out | std::ios::binary | std::ios::trunc);
+        if (!m_file.is_open()) std::cerr << "Unable to create the WARC file " << filename << std::endl;
+        m_segment_bytes = 0;
+        const std::string fields = "software: FFspider\r\nformat: WARC File Format 1.0\r\n";
+        compress("WARC/1.0\r\nWARC-Type: warcinfo\r\nWARC-Record-ID: " + get_record_id() + "\r\nWARC-Date: " + date + "\r\nWARC-Filename: " + filename +
+            "\r\nContent-Type: application/warc-fields\r\nContent-Length: " + std::to_string(fields.size()) + "\r\n\r\n", fields);
+    }
+    // One gzip member per record, appended to the buffer
+    void compress(const std::string& head, const std::string& body) {
+        const size_t start = m_buffer.size();
+        m_buffer.resize(start + deflateBound(&m_zs, static_cast<uLong>(head.size() + body.size() + 4)) + 64);
+        m_zs.next_out = reinterpret_cast<Bytef*>(&m_buffer[start]);
+        m_zs.avail_out = static_cast<uInt>(m_buffer.size() - start);
+        const std::string_view parts[] = { head, body, "\r\n\r\n" };
+        int ret = Z_OK;
+        for (size_t i = 0; i < 3; ++i) {
+            m_zs.next_in = reinterpret_cast<Bytef*>(const_cast<char*>(parts[i].data()));
+            m_zs.avail_in = static_cast<uInt>(parts[i].size());
+            ret = deflate(&m_zs, i == 2 ? Z_FINISH : Z_NO_FLUSH);
+        }
+        if (ret == Z_STREAM_END) m_buffer.resize(m_buffer.size() - m_zs.avail_out);
+        else m_buffer.resize(start);
+        deflateReset(&m_zs);
+    }
+    void flush_buffer() {
+        if (m_file.is_open()) m_file.write(m_buffer.data(), m_buffer.size());
+        m_segment_bytes += m_buffer.size();
+        m_buffer.clear();
+    }
+    // Random (version 4) UUID
+    std::string get_record_id() {
+        const uint64_t high = (m_random() & ~0xF000ULL) | 0x4000ULL, low = (m_random() & 0x3FFFFFFFFFFFFFFFULL) | 0x8000000000000000ULL;
+        char id[64];
+        snprintf(id, sizeof(id), "<urn:uuid:%08x-%04x-%04x-%04x-%012llx>", static_cast<unsigned>(high >> 32), static_cast<unsigned>((high >> 16) & 0xFFFF),
+            static_cast<unsigned>(high & 0xFFFF), static_cast<unsigned>(low >> 48), static_cast<unsigned long long>(low & 0xFFFFFFFFFFFFULL));
+        return id;
+    }
+    bool m_enabled = false, m_closed = false;
+    boost::filesystem::path m_folder;
+    std::mutex m_mtx;
+    std::condition_variable m_not_empty, m_not_full;
+    std::deque<Record> m_records;
+    size_t m_pending_bytes = 0, m_segment = 0, m_segment_bytes = 0;
+    std::atomic<size_t> m_written = 0;
+    std::thread m_thread;
+    std::ofstream m_file;
+    std::string m_buffer;
+    z_stream m_zs = {};
+    std::mt19937_64 m_random{ std::random_device()() };
+};
+WarcWriter warc_writer;
+
+// Image pipeline: image URLs found by the spider threads are downloaded by their own fetch engine,
+// then checked, resized and stored by the image threads
+BoundedQueue<std::string> image_queue(100000);
+BoundedQueue<FetchResult> transcode_queue(transcode_queue_capacity);
+FetchEngine image_fetcher("image/png, image/jpeg", 2500, 8500, max_image_file_size + 1);
+void set_image_status(const std::string& url, const bool stored, const size_t file_size, const size_t width, const size_t height, const std::string& mime,
+    const std::string& etag = "", const std::string& last_modified = "", const std::string& content_hash = "", const std::string& phash = "") {
+    persister.mark_image(url);
+    if (stored) {
+        visited_images++;
+        if (file_size > 0) cached_images++;
+    }
+    std::lock_guard<DbMutex> lck(mtx);
+    if (stored) {
+        memory_storage.update_all(set(c(&ImageData::file_size) = file_size,
+            c(&ImageData::width) = width,
+            c(&ImageData::height) = height,
+            c(&ImageData::mime) = std::make_unique<std::string>(mime),
+            c(&ImageData::etag) = etag,
+            c(&ImageData::last_modified) = last_modified,
+            c(&ImageData::content_hash) = content_hash,
+            c(&ImageData::phash) = phash),
+            where(c(&ImageData::url) == url));
+    }
+    else {
+        memory_storage.update_all(set(c(&ImageData::mime) = unsupported_image_mime), where(c(&ImageData::url) == url));
+    }
+}
+// Download buffers recycled between the image fetch engine and the image threads
+class BufferPool {
+public:
+    std::string take() {
+        std::lock_guard<std::mutex> lck(m_mtx);
+        if (m_buffers.empty()) return std::string();
+        std::string buffer = std::move(m_buffers.back());
+        m_buffers.pop_back();
+        return buffer;
+    }
+    void give(std::string& buffer) {
+        buffer.clear();
+        std::lock_guard<std::mutex> lck(m_mtx);
+        if (m_buffers.size() < max_buffers) m_buffers.push_back(std::move(buffer));
+    }
+
+private:
+    static const size_t max_buffers = 512;
+    std::mutex m_mtx;
+    std::vector<std::string> m_buffers;
+};
+BufferPool image_buffers;
+// Abort the download as soon as we know the image will be rejected
+bool check_image(FetchEngine::Transfer& transfer) {
+    curl_off_t content_length = -1;
+    curl_easy_getinfo(transfer.easy, CURLINFO_CONTENT_LENGTH_DOWNLOAD_T, &content_length);
+    if (content_length > static_cast<curl_off_t>(max_image_file_size)) return false;
+    if (transfer.body.size() >= 8 && get_image_type(transfer.body.data(), 8).empty()) return false;
+    return true;
+}
+bool next_image(const size_t loop_id, std::string& url) {
+    if (transcode_queue.full()) return false; // Let the image threads catch up
+    return image_queue.try_pop(url);
+}
+void image_fetched(const size_t loop_id, FetchEngine::Transfer& transfer) {
+    if (transfer.result != CURLE_OK || transfer.status_code != 200) {
+        if (verbose) std::cerr << "Error downloading image from " << transfer.url << " - " << transfer.status_code << " " << (transfer.truncated ? "too large" : (transfer.rejected ? "rejected" : curl_easy_strerror(transfer.result))) << std::endl;
+        set_image_status(transfer.url, false, 0, 0, 0, "");
+    }
+    else {
+        FetchResult image{ transfer.url, std::move(transfer.body), transfer.etag, transfer.last_modified };
+        if (warc_writer.enabled()) image.content_type = get_content_type(transfer.easy);
+        transfer.body = image_buffers.take();
+        transcode_queue.push(std::move(image));
+    }
+}
+void image_worker() {
+    FetchResult image;
+    while (!stop_requested && transcode_queue.pop(image)) {
+        const auto start = std::chrono::steady_clock::now();
+        size_t file_size = 0, width = 0, height = 0, components = 0;
+        std::string mime(""), phash("");
+        Sha256Digest key;
+        bool stored = false;
+        if (check_image_bytes(image.url, image.body, file_size, width, height, components, mime)) {
+            // Same content as an image already stored, waited for while another thread is storing it
+            const Sha256Digest digest = sha256(image.body);
+            stored = !image_contents.reserve(digest, key);
+            uint64_t hash = 0;
+            if (compute_dhash(image.body, mime, hash)) phash = to_hex(reinterpret_cast<const uint8_t*>(&hash), sizeof(hash));
+            if (stored) {
+                total_duplicate_images++;
+            }
+            else if (!phash.empty() && perceptual_index.find(hash, near_duplicate_distance, key)) {
+                // Looks like an image already stored, point at it instead of storing this one
+                image_contents.set(digest, key);
+                total_duplicate_images++;
+                stored = true;
+            }
+            else if (use_packed_store) {
+                stored = pack_image(image.body, to_hex(key.data(), key.size()), width, height, components, mime);
+                if (stored && !phash.empty()) perceptual_index.insert(hash, key);
+                if (stored) image_contents.commit(digest);
+                else image_contents.remove(digest);
+            }
+            else {
+                std::string filename;
+                get_file_folder(to_hex(key.data(), key.size()), filename);
+                stored = store_image(image.body, filename, width, height, components, mime);
+                if (stored && !phash.empty()) perceptual_index.insert(hash, key);
+                if (stored) image_contents.commit(digest);
+                else image_contents.remove(digest);
+            }
+        }
+        image_decode_latency.record_since(start);
+        set_image_status(image.url, stored, file_size, width, height, mime, image.etag, image.last_modified, stored ? to_hex(key.data(), key.size()) : "", phash);
+        if (warc_writer.enabled()) warc_writer.write(std::move(image));
+        else image_buffers.give(image.body);
+    }
+}
+
+// Bump allocator for the Gumbo parser: the nodes, attributes and texts of a page are carved out of large blocks
+// and the whole tree is released at once by rewinding the arena, instead of one free per allocation
+class ParseArena {
+public:
+    void* allocate(size_t size) {
+        size = (size + 15) & ~static_cast<size_t>(15);
+        if (m_blocks.empty() || m_used + size > m_blocks[m_current].size) next_block(size);
+        void* ptr = m_blocks[m_current].data.get() + m_used;
+        m_used += size;
+        return ptr;
+    }
+    void reset() {
+        m_current = 0;
+        m_used = 0;
+        // Blocks kept for the next pages are bounded, a huge page does not pin its memory to the thread
+        size_t kept = 0, retained = 0;
+        while (kept < m_blocks.size() && retained + m_blocks[kept].size <= max_retained) retained += m_blocks[kept++].size;
+        m_blocks.resize(kept); // Even the first block goes when it is larger than max_retained, the next allocation makes a new one
+    }
+    static void* gumbo_allocate(void* userdata, size_t size) { return static_cast<ParseArena*>(userdata)->allocate(size); }
+    static void gumbo_deallocate(void*, void*) {}
+
+private:
+    static constexpr size_t block_size = 1024 * 1024;
+    static constexpr size_t max_retained = 8 * block_size;
+    struct Block {
+        std::unique_ptr<char[]> data;
+        size_t size;
+    };
+    void next_block(size_t size) {
+        if (!m_blocks.empty()) m_current++;
+        m_used = 0;
+        if (m_current == m_blocks.size() || m_blocks[m_current].size < size) {
+            const size_t new_size = std::max(block_size, size);
+            m_blocks.insert(m_blocks.begin() + m_current, Block{ std::unique_ptr<char[]>(new char[new_size]), new_size });
+        }
+    }
+    std::vector<Block> m_blocks;
+    size_t m_current = 0, m_used = 0;
+};
+thread_local ParseArena parse_arena;
+
+// Parse a page with the arena of the calling thread (or the default allocator), the tree must then be given back to release_page_tree
+GumboOutput* parse_page_tree(const std::string& html) {
+    if (!use_parse_arena) return gumbo_parse_with_options(&kGumboDefaultOptions, html.c_str(), html.size());
+    GumboOptions options = kGumboDefaultOptions;
+    options.allocator = ParseArena::gumbo_allocate;
+    options.deallocator = ParseArena::gumbo_deallocate;
+    options.userdata = &parse_arena;
+    return gumbo_parse_with_options(&options, html.c_str(), html.size());
+}
+void release_page_tree(GumboOutput* doc) {
+    if (doc == nullptr) return;
+    if (use_parse_arena) parse_arena.reset();
+    else gumbo_destroy_output(&kGumboDefaultOptions, doc);
+}
+
+// Peak working set of the process, in MB
+size_t get_peak_memory_mb() {
+    PROCESS_MEMORY_COUNTERS counters;
+    counters.cb = sizeof(counters);
+    if (!GetProcessMemoryInfo(GetCurrentProcess(), &counters, sizeof(counters))) return 0;
+    return counters.PeakWorkingSetSize / (1024 * 1024);
+}
+// User + kernel CPU time of the process, in seconds
+double get_cpu_seconds() {
+    FILETIME creation_time, exit_time, kernel_time, user_time;
+    if (!GetProcessTimes(GetCurrentProcess(), &creation_time, &exit_time, &kernel_time, &user_time)) return 0.0;
+    auto to_seconds = [](const FILETIME& time) { return ((static_cast<uint64_t>(time.dwHighDateTime) << 32) | time.dwLowDateTime) / 1e7; };
+    return to_seconds(kernel_time) + to_seconds(user_time);
+}
+
+// Analyze a downloaded web page
+void parse_page(const std::string& url, const std::string& html, const PageValidators& validators = PageValidators()) {
+    thread_local PageExtract page;
+    GumboOutput* doc = nullptr;
+    std::vector<std::string> new_images;
+    try {
+        // Extract the links (internal and external), the images and their texts in one pass, then publish them
+        const bool with_links = !no_new_urls;
+        page.clear();
+        auto start = std::chrono::steady_clock::now();
+        if (stream_extractor) {
+            extract_page_stream(html, url, with_links, page); // Parsed and extracted in the same pass
+            parse_latency.record_since(start);
+            start = std::chrono::steady_clock::now();
+        }
+        else if ((doc = parse_page_tree(html)) != nullptr) {
+            parse_latency.record_since(start);
+            start = std::chrono::steady_clock::now();
+            extract_page(doc->root, url, with_links, page);
+        }
+        // Near duplicate of a page recently parsed (print view, sort order, tracking parameters...): its links and images are already known
+        const uint64_t fingerprint = page.simhash.value();
+        if (page_dedup && fingerprint != 0 && page_fingerprints.check_and_insert(fingerprint, url_fingerprint(url))) {
+            total_pruned_pages++;
+        }
+        else {
+            if (with_links) publish_links(page);
+            publish_images(page, url, new_images);
+        }
+        extract_latency.record_since(start);
+        crawl_log.record(url, 200, validators);
+    }
+    catch(...) {
+        if (verbose) std::cout << "Critical issue occured during a web page analysis: " << url << std::endl;
+        crawl_log.record(url, 503);
+    }
+    release_page_tree(doc);
+    // The page tree is released, now hand the new images over to the image pipeline (blocks while it is saturated)
+    for (auto& image_url : new_images) image_queue.push(std::move(image_url));
+}
+
+BoundedQueue<FetchResult> parse_queue(parse_queue_capacity);
+
+// Network side of the spider: pages are fetched by the event loops of the engine...
+FetchEngine page_fetcher("text/*", 2500, 5500, max_html_page_size);
+bool next_page(const size_t loop_id, std::string& url) {
+    if (parse_queue.full()) return false; // Let the parsing threads catch up
+    return frontier.pop(loop_id, url);
+}
+void page_fetched(const size_t loop_id, FetchEngine::Transfer& transfer) {
+    frontier.release(transfer.url);
+    const bool ok = (transfer.result == CURLE_OK || transfer.truncated);
+    if (ok && transfer.status_code == 304 && recrawl_scheduler.revisiting(transfer.url)) {
+        // Not modified since the previous visit, nothing to parse
+        PageValidators validators;
+        recrawl_scheduler.visited(transfer.url, transfer.etag, transfer.last_modified, "", validators);
+        crawl_log.record(transfer.url, 200, validators);
+        total_pages++;
+    }
+    else if ((!ok || transfer.status_code != 200) && recrawl_scheduler.failed(transfer.url)) {
+        total_pages++;
+    }
+    else if (!ok) {
+        if (verbose) std::cout << "Error downloading page " << transfer.url << " - " << curl_easy_strerror(transfer.result) << std::endl;
+        crawl_log.record(transfer.url, 503);
+        total_pages++;
+    }
+    else if (transfer.status_code != 200) {
+        crawl_log.record(transfer.url, transfer.status_code);
+        total_pages++;
+    }
+    else {
+        parse_queue.push(FetchResult{ transfer.url, std::move(transfer.body), transfer.etag, transfer.last_modified, warc_writer.enabled() ? get_content_type(transfer.easy) : "" });
+    }
+}
+
+// ... and parsed by the spider threads
+void spider() {
+    FetchResult page;
+    while (!stop_requested && parse_queue.pop(page)) {
+        PageValidators validators;
+        if (recrawl_scheduler.visited(page.url, page.etag, page.last_modified, get_content_hash(page.body), validators)) parse_page(page.url, page.body, validators);
+        else crawl_log.record(page.url, 200, validators); // Same content as the previous visit
+        total_pages++;
+        if (warc_writer.enabled()) warc_writer.write(std::move(page));
+    }
+}
+
+// Value of a field of WARC or HTTP headers ("" if missing)
+std::string get_header_field(const std::string& headers, const std::string& name) {
+    size_t pos = 0;
+    while (pos < headers.size()) {
+        size_t end = headers.find("\r\n", pos);
+        if (end == std::string::npos) end = headers.size();
+        const size_t colon = headers.find(':', pos);
+        if (colon < end && boost::algorithm::iequals(headers.substr(pos, colon - pos), name)) return boost::algorithm::trim_copy(headers.substr(colon + 1, end - colon - 1));
+        pos = end + 2;
+    }
+    return "";
+}
+
+// Sequential reader of WARC files, compressed with one gzip member per record or not compressed at all
+class WarcReader {
+public:
+    // Called with the headers and the content block of each record
+    using RecordFunction = std::function<void(const std::string& headers, std::string& block)>;
+    bool read(const boost::filesystem::path& filename, const RecordFunction& callback) {
+        std::ifstream file(filename.string(), std::ios::in | std::ios::binary);
+        if (!file.is_open()) return false;
+        const bool compressed = filename.extension() == ".gz";
+        z_stream zs = {};
+        if (compressed && inflateInit2(&zs, 15 + 32) != Z_OK) return false;
+        std::string input(read_size, '\0'), output(read_size, '\0');
+        m_data.clear();
+        m_offset = 0;
+        m_error = false;
+        while (!m_error && !stop_requested) {
+            file.read(&input[0], input.size());
+            const size_t size = static_cast<size_t>(file.gcount());
+            if (size == 0) break;
+            if (!compressed) {
+                m_data.append(input.data(), size);
+                parse(callback);
+                continue;
+            }
+            zs.next_in = reinterpret_cast<Bytef*>(&input[0]);
+            zs.avail_in = static_cast<uInt>(size);
+            while (zs.avail_in > 0 && !m_error) {
+                zs.next_out = reinterpret_cast<Bytef*>(&output[0]);
+                zs.avail_out = static_cast<uInt>(output.size());
+                const int ret = inflate(&zs, Z_NO_FLUSH);
+                m_data.append(output.data(), output.size() - zs.avail_out);
+                if (ret == Z_STREAM_END) inflateReset(&zs); // Next record
+                else if (ret != Z_OK) m_error = true;
+                parse(callback);
+            }
+        }
+        if (compressed) inflateEnd(&zs);
+        return !m_error && m_offset == m_data.size();
+    }
+
+private:
+    static const size_t read_size = 4 * 1024 * 1024;
+    void parse(const RecordFunction& callback) {
+        while (!m_error) {
+            if (m_data.size() - m_offset < 5) break;
+            if (m_data.compare(m_offset, 5, "WARC/") != 0) {
+                m_error = true;
+                break;
+            }
+            const size_t headers_end = m_data.find("\r\n\r\n", m_offset);
+            if (headers_end == std::string::npos) break;
+            const std::string headers = m_data.substr(m_offset, headers_end - m_offset);
+            const size_t block_start = headers_end + 4, block_size = std::strtoull(get_header_field(headers, "Content-Length").c_str(), nullptr, 10);
+            if (m_data.size() < block_start + block_size + 4) break; // The record ends with 2 CRLF
+            std::string block = m_data.substr(block_start, block_size);
+            m_offset = block_start + block_size + 4;
+            callback(headers, block);
+        }
+        if (m_offset * 2 >= m_data.size()) {
+            m_data.erase(0, m_offset);
+            m_offset = 0;
+        }
+    }
+    std::string m_data;
+    size_t m_offset = 0;
+    bool m_error = false;
 };
 
-// Image metadata struct
-struct ImageData {
-    std::string url;
-    std::unique_ptr<std::string> alt;
-    std::string source_page;
-    std::unique_ptr<std::string> surrounding_text;
-    std::size_t file_size;
-    std::size_t width;
-    std::size_t height;
-    std::unique_ptr<std::string> mime;
-    std::string last_seen;
+// Feed the archived responses to the spider and image threads, as the fetch engines would: the pages are extracted
+// again with the current rules at the parsing speed. Only the images waiting for a download when the replay starts are
+// processed, once each: the others are already in the content-addressed store or found by the replayed pages
+void replay_warc(const boost::filesystem::path& path, std::unordered_set<uint64_t> pending_images) {
+    std::vector<boost::filesystem::path> files;
+    if (boost::filesystem::is_directory(path)) {
+        for (boost::filesystem::directory_iterator it(path), end; it != end; ++it) {
+            const std::string name = it->path().filename().string();
+            if (boost::filesystem::is_regular_file(*it) && (boost::algorithm::ends_with(name, ".warc.gz") || boost::algorithm::ends_with(name, ".warc"))) files.push_back(it->path());
+        }
+        std::sort(files.begin(), files.end());
+    }
+    else {
+        files.push_back(path);
+    }
+    size_t nb_pages = 0, nb_images = 0;
+    ElapsedTime timer;
+    WarcReader reader;
+    for (auto& file : files) {
+        const bool ok = reader.read(file, [&](const std::string& headers, std::string& block) {
+            if (stop_requested || !boost::algorithm::iequals(get_header_field(headers, "WARC-Type"), "response")) return;
+            const std::string url = get_header_field(headers, "WARC-Target-URI");
+            const size_t http_end = block.find("\r\n\r\n");
+            if (url.empty() || http_end == std::string::npos || block.compare(0, 5, "HTTP/") != 0) return;
+            const std::string http = block.substr(0, http_end);
+            const size_t space = http.find(' ');
+            if (space == std::string::npos || std::atoi(http.c_str() + space + 1) != 200) return;
+            block.erase(0, http_end + 4);
+            FetchResult response{ url, std::move(block), get_header_field(http, "ETag"), get_header_field(http, "Last-Modified"), get_header_field(http, "Content-Type") };
+            if (boost::algorithm::istarts_with(response.content_type, "image/") || !get_image_type(response.body.data(), response.body.size()).empty()) {
+                if (pending_images.erase(url_fingerprint(url)) != 0 && transcode_queue.push(std::move(response))) nb_images++;
+            }
+            else if (parse_queue.push(std::move(response))) {
+                nb_pages++;
+            }
+            });
+        if (!ok && !stop_requested) std::cerr << "Unable to read all the records of " << file.string() << std::endl;
+        if (stop_requested) break;
+    }
+    std::cout << std::endl << "Replayed " << nb_pages << " pages and " << nb_images << " images from " << files.size() << " WARC files in " << timer.getSeconds() << " s" << std::endl;
+}
+
+// Metrics of the crawl: the counters and the latency of each stage
+std::vector<std::pair<std::string, const LatencyHistogram*>> get_stage_latencies() {
+    return { { "dns", &dns_latency }, { "connect", &connect_latency }, { "page_fetch", &page_fetcher.fetch_latency() }, { "parse", &parse_latency },
+        { "extract", &extract_latency }, { "image_fetch", &image_fetcher.fetch_latency() }, { "image_decode", &image_decode_latency }, { "db_lock_wait", &db_wait_latency } };
+}
+std::vector<std::pair<std::string, size_t>> get_counters() {
+    return { { "pages", total_pages }, { "images", total_images }, { "visited_pages", visited_pages }, { "visited_images", visited_images },
+        { "cached_images", cached_images }, { "duplicate_images", total_duplicate_images }, { "pruned_pages", total_pruned_pages },
+        { "new_connections", page_fetcher.new_connections() + image_fetcher.new_connections() }, { "reused_connections", page_fetcher.reused_connections() + image_fetcher.reused_connections() },
+        { "http2_responses", page_fetcher.http2_transfers() + image_fetcher.http2_transfers() },
+        { "wire_bytes", page_fetcher.wire_bytes() + image_fetcher.wire_bytes() }, { "decoded_bytes", page_fetcher.decoded_bytes() + image_fetcher.decoded_bytes() } };
+}
+
+// Prometheus text format. The stage histograms are exposed with one bucket per power of 2 microseconds
+std::string get_prometheus_metrics() {
+    std::stringstream out;
+    for (auto& counter : get_counters()) {
+        out << "# TYPE ffspider_" << counter.first << "_total counter" << std::endl;
+        out << "ffspider_" << counter.first << "_total " << counter.second << std::endl;
+    }
+    out << "# TYPE ffspider_pending_pages gauge" << std::endl << "ffspider_pending_pages " << frontier.size() << std::endl;
+    out << "# TYPE ffspider_spilled_pages gauge" << std::endl << "ffspider_spilled_pages " << frontier.spilled() << std::endl;
+    out << "# TYPE ffspider_peak_memory_bytes gauge" << std::endl << "ffspider_peak_memory_bytes " << get_peak_memory_mb() * 1024 * 1024 << std::endl;
+    out << "# TYPE ffspider_stage_seconds histogram" << std::endl;
+    for (auto& stage : get_stage_latencies()) {
+        const LatencyHistogram::Snapshot snap = stage.second->snapshot();
+        for (int shift = 6; shift <= 26; ++shift) {
+            out << "ffspider_stage_seconds_bucket{stage=\"" << stage.first << "\",le=\"" << (uint64_t(1) << shift) / 1e6 << "\"} " << snap.count_below(uint64_t(1) << shift) << std::endl;
+        }
+        out << "ffspider_stage_seconds_bucket{stage=\"" << stage.first << "\",le=\"+Inf\"} " << snap.count << std::endl;
+        out << "ffspider_stage_seconds_sum{stage=\"" << stage.first << "\"} " << snap.sum / 1e6 << std::endl;
+        out << "ffspider_stage_seconds_count{stage=\"" << stage.first << "\"} " << snap.count << std::endl;
+    }
+    return out.str();
+}
+
+// Small local HTTP endpoint serving the metrics on GET /metrics
+class MetricsServer {
+public:
+    bool start(unsigned short port) {
+        try {
+            m_acceptor = std::make_unique<boost::asio::ip::tcp::acceptor>(m_io, boost::asio::ip::tcp::endpoint(boost::asio::ip::address_v4::loopback(), port));
+        }
+        catch (std::exception& e) {
+            std::cerr << "Unable to serve the metrics on port " << port << " - " << e.what() << std::endl;
+            return false;
+        }
+        accept();
+        m_thread = std::thread([this]() { m_io.run(); });
+        return true;
+    }
+    void stop() {
+        m_io.stop();
+        if (m_thread.joinable()) m_thread.join();
+    }
+
+private:
+    struct Connection {
+        Connection(boost::asio::ip::tcp::socket s, boost::asio::io_context& io) : socket(std::move(s)), request(8192), deadline(io) {}
+        boost::asio::ip::tcp::socket socket;
+        boost::asio::streambuf request;
+        boost::asio::steady_timer deadline;
+        std::string response;
+    };
+    void accept() {
+        m_acceptor->async_accept([this](const boost::system::error_code& ec, boost::asio::ip::tcp::socket socket) {
+            if (!ec) serve(std::make_shared<Connection>(std::move(socket), m_io));
+            accept();
+            });
+    }
+    // One request per connection, read and answered asynchronously so that a slow or silent client never holds the io thread.
+    // It is closed when the deadline expires first
+    void serve(std::shared_ptr<Connection> conn) {
+        conn->deadline.expires_after(std::chrono::seconds(metrics_request_timeout));
+        conn->deadline.async_wait([conn](const boost::system::error_code& ec) {
+            boost::system::error_code close_ec;
+            if (!ec) conn->socket.close(close_ec);
+            });
+        boost::asio::async_read_until(conn->socket, conn->request, "\r\n\r\n", [conn](const boost::system::error_code& ec, size_t) {
+            if (ec) {
+                conn->deadline.cancel();
+                return;
+            }
+            std::string request_line;
+            std::istream stream(&conn->request);
+            std::getline(stream, request_line);
+            const bool found = request_line.compare(0, 13, "GET /metrics ") == 0;
+            const std::string body = found ? get_prometheus_metrics() : "Not found\n";
+            std::stringstream response;
+            response << "HTTP/1.1 " << (found ? "200 OK" : "404 Not Found") << "\r\nContent-Type: text/plain; version=0.0.4\r\nContent-Length: " << body.size() << "\r\nConnection: close\r\n\r\n" << body;
+            conn->response = response.str();
+            boost::asio::async_write(conn->socket, boost::asio::buffer(conn->response), [conn](const boost::system::error_code& ec, size_t) {
+                boost::system::error_code shutdown_ec;
+                if (!ec) conn->socket.shutdown(boost::asio::ip::tcp::socket::shutdown_both, shutdown_ec);
+                conn->deadline.cancel();
+                });
+            });
+    }
+    boost::asio::io_context m_io;
+    std::unique_ptr<boost::asio::ip::tcp::acceptor> m_acceptor;
+    std::thread m_thread;
 };
+MetricsServer metrics_server;
 
-// Database connection and table mapping
-auto storage = make_storage("queues.db",
-    sqlite_orm::make_table("images",
-        make_column("url", &ImageData::url, unique()),
-        make_column("alt", &ImageData::alt),
-        make_column("source", &ImageData::source_page),
-        make_column("surrounding", &ImageData::surrounding_text),
-        make_column("file_size", &ImageData::file_size),
-        make_column("width", &ImageData::width),
-        make_column("height", &ImageData::height),
-        make_column("mime", &ImageData::mime),
-        make_column("last_seen", &ImageData::last_seen)),
-    sqlite_orm::make_table("urls",
-        make_column("url", &UrlData::url, unique()),
-        make_column("last_crawled", &UrlData::last_crawled),
-        make_column("last_seen", &UrlData::last_seen),
-        make_column("status_code", &UrlData::status_code))
-);
-// In memory structure
-auto memory_storage = make_storage(":memory:",
-    make_table("images",
-        make_column("url", &ImageData::url, unique()),
-        make_column("alt", &ImageData::alt),
-        make_column("source", &ImageData::source_page),
-        make_column("surrounding", &ImageData::surrounding_text),
-        make_column("file_size", &ImageData::file_size),
-        make_column("width", &ImageData::width),
-        make_column("height", &ImageData::height),
-        make_column("mime", &ImageData::mime),
-        make_column("last_seen", &ImageData::last_seen)),
-    make_table("urls",
-        make_column("url", &UrlData::url, unique()),
-        make_column("last_crawled", &UrlData::last_crawled),
-        make_column("last_seen", &UrlData::last_seen),
-        make_column("status_code", &UrlData::status_code))
-);
+// JSON line of the metrics of each refresh interval: counters with their rates, stage latencies over the interval
+class MetricsLog {
+public:
+    bool open(const std::string& filename) {
+        m_file.open(filename, std::ios::out | std::ios::app);
+        for (auto& stage : get_stage_latencies()) m_previous_stages.push_back(stage.second->snapshot());
+        for (auto& counter : get_counters()) m_previous_counters.push_back(counter.second);
+        return m_file.is_open();
+    }
+    void write(const double interval_seconds) {
+        if (!m_file.is_open()) return;
+        const double seconds = std::max(0.001, interval_seconds);
+        std::stringstream line;
+        line << std::fixed << std::setprecision(3) << "{\"time\":\"" << get_current_time() << "\",\"interval_s\":" << seconds;
+        line << ",\"pending_pages\":" << frontier.size() << ",\"peak_memory_mb\":" << get_peak_memory_mb();
+        const auto counters = get_counters();
+        for (size_t i = 0; i < counters.size(); ++i) {
+            line << ",\"" << counters[i].first << "\":" << counters[i].second << ",\"" << counters[i].first << "_per_sec\":" << (counters[i].second - m_previous_counters[i]) / seconds;
+            m_previous_counters[i] = counters[i].second;
+        }
+        line << ",\"stages\":{";
+        const auto stages = get_stage_latencies();
+        for (size_t i = 0; i < stages.size(); ++i) {
+            const LatencyHistogram::Snapshot snap = stages[i].second->snapshot();
+            const LatencyHistogram::Snapshot delta = snap.since(m_previous_stages[i]);
+            m_previous_stages[i] = snap;
+            line << (i == 0 ? "" : ",") << "\"" << stages[i].first << "\":{\"count\":" << delta.count << ",\"per_sec\":" << delta.count / seconds;
+            line << ",\"mean_ms\":" << (delta.count == 0 ? 0.0 : delta.sum / 1000.0 / delta.count) << ",\"p50_ms\":" << delta.percentile(0.5) / 1000.0;
+            line << ",\"p90_ms\":" << delta.percentile(0.9) / 1000.0 << ",\"p99_ms\":" << delta.percentile(0.99) / 1000.0 << "}";
+        }
+        line << "}}";
+        m_file << line.str() << std::endl;
+    }
 
-std::string get_current_time() {
-    auto now = std::chrono::system_clock::now();
-    std::time_t time_now = std::chrono::system_clock::to_time_t(now);
+private:
+    std::ofstream m_file;
+    std::vector<LatencyHistogram::Snapshot> m_previous_stages;
+    std::vector<size_t> m_previous_counters;
+};
 
-    struct tm tm;
-    localtime_s(&tm, &time_now);
+// Maintenance of the image cache
+static std::atomic<size_t> nb_imgs = 0;
+const size_t nb_imgs_display = 5000;
 
-    std::stringstream stream;
-    stream << std::put_time(&tm, "%Y-%m-%d %H:%M:%S");
-    return stream.str();
+// Run task(i) for each i in [0, count) on num_threads threads. Each thread starts with its own share of the items
+// and, once it is done, steals from the back of the others, so that a few large folders never keep a single thread busy
+void run_work_stealing(const size_t count, const size_t num_threads, const std::function<void(size_t)>& task) {
+    struct Queue {
+        std::mutex mtx;
+        std::deque<size_t> items;
+    };
+    std::vector<Queue> queues(std::max<size_t>(1, num_threads));
+    for (size_t i = 0; i < count; ++i) queues[i % queues.size()].items.push_back(i);
+    auto worker = [&](const size_t id) {
+        while (!stop_requested) {
+            size_t item = 0;
+            bool found = false;
+            for (size_t k = 0; k < queues.size() && !found; ++k) {
+                Queue& q = queues[(id + k) % queues.size()];
+                std::lock_guard<std::mutex> lck(q.mtx);
+                if (q.items.empty()) continue;
+                if (k == 0) {
+                    item = q.items.front();
+                    q.items.pop_front();
+                }
+                else {
+                    item = q.items.back();
+                    q.items.pop_back();
+                }
+                found = true;
+            }
+            if (!found) return;
+            task(item);
+        }
+    };
+    std::vector<std::thread> threads;
+    for (size_t i = 1; i < queues.size(); ++i) threads.emplace_back(worker, i);
+    worker(0);
+    for (auto& thread : threads) thread.join();
+}
+
+// The leaf folders of the image cache (img_cache/<c>/<c>), where the files are
+std::vector<boost::filesystem::path> list_cache_folders(const boost::filesystem::path& root) {
+    std::vector<boost::filesystem::path> folders;
+    boost::system::error_code ec;
+    for (boost::filesystem::directory_iterator top(root, ec), end; !ec && top != end; top.increment(ec)) {
+        if (!boost::filesystem::is_directory(top->path())) continue;
+        boost::system::error_code sub_ec;
+        for (boost::filesystem::directory_iterator sub(top->path(), sub_ec); !sub_ec && sub != end; sub.increment(sub_ec)) {
+            if (boost::filesystem::is_directory(sub->path())) folders.push_back(sub->path());
+        }
+    }
+    return folders;
+}
+
+// Rename a file, or copy then remove it when the destination is on another drive
+bool move_file(const boost::filesystem::path& src, const boost::filesystem::path& dst, std::atomic<bool>& same_drive) {
+    boost::system::error_code ec;
+    if (same_drive) {
+        boost::filesystem::rename(src, dst, ec);
+        if (!ec) return true;
+        if (ec == boost::system::errc::cross_device_link) same_drive = false; // No need to try again for the next files
+    }
+    boost::filesystem::copy_file(src, dst, boost::filesystem::copy_option::overwrite_if_exists, ec);
+    if (ec) return false;
+    boost::filesystem::remove(src, ec);
+    return true;
+}
+
+// Move the image files from source to destination, keeping their folders
+void move_images(const boost::filesystem::path& src, const boost::filesystem::path& dst, std::atomic<bool>& same_drive) {
+    if (!boost::filesystem::is_directory(src)) return;
+    const std::vector<boost::filesystem::path> folders = list_cache_folders(src);
+    // All the destination folders are created once, before moving any file
+    std::vector<boost::filesystem::path> dst_folders;
+    for (auto& folder : folders) {
+        dst_folders.push_back(dst / folder.parent_path().filename() / folder.filename());
+        boost::system::error_code ec;
+        boost::filesystem::create_directories(dst_folders.back(), ec);
+    }
+    run_work_stealing(folders.size(), std::max<size_t>(1, std::thread::hardware_concurrency()), [&](const size_t i) {
+        boost::system::error_code ec;
+        for (boost::filesystem::directory_iterator it(folders[i], ec), end; !ec && it != end && !stop_requested; it.increment(ec)) {
+            if (it->path().extension() != ".jpg" || !boost::filesystem::is_regular_file(it->path())) continue;
+            if (!move_file(it->path(), dst_folders[i] / it->path().filename(), same_drive) && verbose) std::cerr << "Unable to move " << it->path().string() << std::endl;
+            if ((nb_imgs++ % nb_imgs_display) == 0) std::cout << ".";
+        }
+        });
+}
+
+// Move image files and metadata
+void move(const boost::filesystem::path& src_root, const boost::filesystem::path& dst_root) {
+    const boost::filesystem::path img_cache_dir = src_root / "img_cache";
+    const boost::filesystem::path db_dest_path = dst_root / "queues.db";
+
+    // Move image files, renamed when the destination is on the same drive
+    std::cout << "Moving images ";
+    std::atomic<bool> same_drive = true;
+    move_images(img_cache_dir, dst_root / img_cache_dir.filename(), same_drive);
+    // The segments of the packed store are moved as they are
+    const boost::filesystem::path img_store_dir = src_root / "img_store";
+    if (boost::filesystem::is_directory(img_store_dir)) {
+        if (!exists(dst_root / "img_store")) create_directory(dst_root / "img_store");
+        for (boost::filesystem::directory_iterator it(img_store_dir), end; it != end && !stop_requested; ++it) {
+            if (!boost::filesystem::is_regular_file(*it) || it->path().extension() != ".bin") continue;
+            move_file(it->path(), dst_root / "img_store" / it->path().filename(), same_drive);
+            std::cout << ".";
+        }
+    }
+    std::cout << " done" << std::endl << std::endl;
+
+    // Open the detination sqlite database and insert metadata. Iterate over all images in the database
+    // For each image, read metadata and insert into destination database
+    std::cout << "Updating metadata... ";
+    auto dst_storage = make_storage(db_dest_path.string(),
+        make_table("images",
+            make_column("url", &ImageData::url, unique()),
+            make_column("alt", &ImageData::alt),
+            make_column("source", &ImageData::source_page),
+            make_column("surrounding", &ImageData::surrounding_text),
+            make_column("file_size", &ImageData::file_size),
+            make_column("width", &ImageData::width),
+            make_column("height", &ImageData::height),
+            make_column("mime", &ImageData::mime),
+            make_column("last_seen", &ImageData::last_seen),
+            make_column("etag", &ImageData::etag, default_value("")),
+            make_column("last_modified", &ImageData::last_modified, default_value("")),
+            make_column("content_hash", &ImageData::content_hash, default_value("")),
+            make_column("phash", &ImageData::phash, default_value(""))),
+        make_table("blobs",
+            make_column("key", &ImageBlob::key, unique()),
+            make_column("segment", &ImageBlob::segment),
+            make_column("offset", &ImageBlob::offset),
+            make_column("size", &ImageBlob::size))
+    );
+    dst_storage.sync_schema();
+    dst_storage.transaction([&]() mutable {
+        for (auto& img : storage.iterate<ImageData>()) { // Streamed, the table does not fit in memory
+            try { dst_storage.insert(img); }
+            catch (...) {}
+        }
+        for (auto& blob : storage.iterate<ImageBlob>()) dst_storage.replace(blob);
+        return true;
+        });
+    std::cout << " done" << std::endl << std::endl;
+}
+
+// Function to synchronize image cache on disk and info into a database
+void sync_image_cache(void) {
+    // Keys of all the images of the database, streamed. Several URLs may share the same content
+    std::cout << "Reading the database ";
+    nb_imgs = 0;
+    std::unordered_set<uint64_t> image_keys;
+    for (auto& img : storage.iterate<ImageData>()) {
+        image_keys.insert(get_image_key(img.url, img.content_hash));
+        if ((nb_imgs++ % nb_imgs_display) == 0) std::cout << ".";
+        if (stop_requested) break;
+    }
+    if (stop_requested) return; // Incomplete keys, nothing may be removed
+    std::cout << std::endl << " done" << std::endl;
+
+    // Remove files on disk for which the hash is not present in the database, the folders being scanned in parallel
+    const boost::filesystem::path img_cache_dir = boost::filesystem::current_path() / "img_cache";
+    std::cout << "Updating the image cache ";
+    nb_imgs = 0;
+    std::atomic<size_t> removed_imgs = 0;
+    const std::vector<boost::filesystem::path> folders = list_cache_folders(img_cache_dir);
+    if (!stop_requested) run_work_stealing(folders.size(), std::max<size_t>(1, std::thread::hardware_concurrency()), [&](const size_t i) {
+        boost::system::error_code ec;
+        for (boost::filesystem::directory_iterator it(folders[i], ec), end; !ec && it != end && !stop_requested; it.increment(ec)) {
+            boost::filesystem::path p = it->path();
+            if (p.extension() != ".jpg" || !boost::filesystem::is_regular_file(p)) continue;
+            uint64_t key = 0;
+            if (parse_image_key(calculate_md5_from_path(p), key) && image_keys.count(key) == 0) {
+                boost::system::error_code remove_ec;
+                if (boost::filesystem::remove(p, remove_ec)) removed_imgs++;
+            }
+            if ((nb_imgs++ % nb_imgs_display) == 0) std::cout << ".";
+        }
+        });
+    std::cout << " done - " << removed_imgs << " image(s) removed)" << std::endl << std::endl;
+
+    // Forget the entries of the packed store for which the hash is not present in the database, --compact-store reclaims their space
+    if (stop_requested) return;
+    std::vector<std::string> removed_blobs;
+    for (auto& blob : storage.iterate<ImageBlob>()) {
+        uint64_t key = 0;
+        if (!parse_image_key(blob.key, key) || image_keys.count(key) == 0) removed_blobs.push_back(blob.key);
+        if (stop_requested) break;
+    }
+    storage.transaction([&]() mutable {
+        for (size_t i = 0; i < removed_blobs.size(); i += 500) {
+            std::vector<std::string> bound_keys(removed_blobs.begin() + i, removed_blobs.begin() + std::min<size_t>(i + 500, removed_blobs.size()));
+            storage.remove_all<ImageBlob>(where(in(&ImageBlob::key, bound_keys)));
+        }
+        return true;
+        });
+    if (!removed_blobs.empty()) std::cout << removed_blobs.size() << " packed image(s) unreferenced" << std::endl << std::endl;
+}
+
+// Rewrite the packed store without the records no image points at anymore: removed images, contents appended twice,
+// writes interrupted before their index was saved. The live records are copied into new segments, one old segment at a time
+void compact_store(void) {
+    std::cout << "Reading the database ";
+    std::unordered_set<std::string> live_keys;
+    for (auto& img : storage.iterate<ImageData>()) {
+        if (img.file_size > 0 && img.content_hash.size() == 64) live_keys.insert(img.content_hash);
+    }
+    std::map<size_t, std::vector<ImageBlob>> blobs;
+    for (auto& blob : storage.iterate<ImageBlob>()) blobs[blob.segment].push_back(std::move(blob));
+    std::cout << " done" << std::endl;
+
+    std::cout << "Compacting the packed store ";
+    packed_store.open(boost::filesystem::current_path() / "img_store");
+    const std::vector<size_t> old_segments = packed_store.segments();
+    packed_store.start_segment();
+    size_t old_bytes = 0, new_bytes = 0, kept = 0, dropped = 0;
+    for (const size_t segment : old_segments) {
+        if (stop_requested) break;
+        std::vector<ImageBlob>& entries = blobs[segment];
+        std::sort(entries.begin(), entries.end(), [](const ImageBlob& a, const ImageBlob& b) { return a.offset < b.offset; });
+        std::vector<ImageBlob> moved;
+        std::vector<std::string> removed;
+        std::string data;
+        bool ok = true;
+        for (auto& blob : entries) {
+            ImageBlob new_blob;
+            if (live_keys.count(blob.key) == 0 || !packed_store.read(blob, data)) removed.push_back(blob.key);
+            else if (packed_store.append(blob.key, data, new_blob)) moved.push_back(std::move(new_blob));
+            else {
+                ok = false; // Out of disk space: keep this segment
+                break;
+            }
+        }
+        if (!ok) break;
+        storage.transaction([&]() mutable {
+            for (size_t i = 0; i < moved.size(); i += 100) storage.replace_range(moved.begin() + i, moved.begin() + std::min<size_t>(i + 100, moved.size()));
+            for (size_t i = 0; i < removed.size(); i += 500) {
+                std::vector<std::string> bound_keys(removed.begin() + i, removed.begin() + std::min<size_t>(i + 500, removed.size()));
+                storage.remove_all<ImageBlob>(where(in(&ImageBlob::key, bound_keys)));
+            }
+            return true;
+            });
+        old_bytes += packed_store.segment_size(segment);
+        for (auto& blob : moved) new_bytes += PackedImageStore::header_size + blob.size;
+        kept += moved.size();
+        dropped += removed.size();
+        packed_store.remove_segment(segment);
+        std::cout << ".";
+    }
+    std::cout << " done - " << kept << " image(s) kept, " << dropped << " dropped, " << (old_bytes - std::min(old_bytes, new_bytes)) / (1024 * 1024) << " MB reclaimed" << std::endl << std::endl;
+}
+
+// Previous regex based URL resolver, kept as the reference of the URL benchmark
+std::string get_abs_url_legacy(const std::string& link, const std::string& base_url, const bool for_image) {
+    std::string abs_url("");
+    std::regex js_regex("(javascript:|data:image/|mailto:)", std::regex_constants::icase);
+    if (std::regex_search(link, js_regex)) return abs_url;
+
+    // Check if the link is already an absolute URL
+    std::regex http_regex("^https?://", std::regex_constants::icase);
+    if (std::regex_search(link, http_regex)) return link;
+
+    // Check if the link starts with a slash, indicating a relative URL    
+    if (link[0] == '/') {
+        std::regex base_http_regex("^https?://[^/]+", std::regex_constants::icase);
+        std::smatch base_match;
+        if (std::regex_search(base_url, base_match, base_http_regex)) {
+            std::string base_domain = base_match[0];
+            abs_url = base_domain + link;
+        }
+    }
+    else { // Otherwise, assume the link is a relative URL
+        std::string base_dir = base_url.substr(0, base_url.find_last_of('/') + 1);
+        abs_url = base_dir + link;
+
+        // Test if the link starts with a domain name
+        std::regex domain_regex("^[^/]+\\.(com|org|net|edu|gov|mil|biz|info|name|museum|us|ca|uk|fr|de|jp|ru|cn|es|it|au|nz|ch|nl|be|se|no|fi|dk|at|gr|ie|pl|pt|cz|ro|hu|sk|hr|bg|rs|lv|lt|ee|is|cy|lu|mt|md|al|ad|li|mc|sm|va|by|ua|kz|uz|tm|kg|ge|am|az|tr|il|in|ae|sa|ir|kw|bh|qa|om|ye|ps|lb|jo|sy|iq|eg|ly|dz|ma|tn|sd|er|so|ke|et|dj|ug|bi|rw|mg|mu|sc|za|na|bw|zw|zm|sz|ls|mw|sz|gq|ga|st|cv|td|km|so|cg|ci|lr|sl|gh|ng|cm|cf|tn|mr|sn|gn|gw|tg|bf|ne|mg|mu|re|yt|tf|nf|aq|hm|bv|gs)$", std::regex_constants::icase);
+        if (std::regex_search(link, domain_regex)) {
+            // Prepend the protocol to the domain name
+            std::regex base_http_regex("^https?://", std::regex_constants::icase);
+            std::smatch base_match;
+            if (std::regex_search(base_url, base_match, base_http_regex)) {
+                std::string protocol = base_match[0];
+                abs_url = protocol + link;
+            }
+        }        
+    }
+    // Remove any query string or fragment identifier
+    abs_url = abs_url.substr(0, abs_url.find_first_of(for_image ? "?#" : "#"));
+    if (abs_url.back() == '/') abs_url.pop_back();
+    boost::replace_all(abs_url, " ", "%20");
+    return (abs_url.size() < max_url_length ? abs_url : "");
+}
+
+// Check the URL resolver against a corpus of references and compare its speed with the previous regex based resolver
+void bench_urls() {
+    struct UrlCase {
+        const char* link;
+        const char* base;
+        bool for_image;
+        const char* expected;
+    };
+    // RFC 3986 (section 5.4) examples, with fragments and trailing slashes removed as the crawler does
+    const UrlCase cases[] = {
+        { "g:h", "http://a/b/c/d;p?q", false, "" },
+        { "g", "http://a/b/c/d;p?q", false, "http://a/b/c/g" },
+        { "./g", "http://a/b/c/d;p?q", false, "http://a/b/c/g" },
+        { "g/", "http://a/b/c/d;p?q", false, "http://a/b/c/g" },
+        { "/g", "http://a/b/c/d;p?q", false, "http://a/g" },
+        { "//g", "http://a/b/c/d;p?q", false, "http://g" },
+        { "?y", "http://a/b/c/d;p?q", false, "http://a/b/c/d;p?y" },
+        { "g?y", "http://a/b/c/d;p?q", false, "http://a/b/c/g?y" },
+        { "#s", "http://a/b/c/d;p?q", false, "http://a/b/c/d;p?q" },
+        { "g#s", "http://a/b/c/d;p?q", false, "http://a/b/c/g" },
+        { "g?y#s", "http://a/b/c/d;p?q", false, "http://a/b/c/g?y" },
+        { ";x", "http://a/b/c/d;p?q", false, "http://a/b/c/;x" },
+        { "g;x", "http://a/b/c/d;p?q", false, "http://a/b/c/g;x" },
+        { "g;x?y#s", "http://a/b/c/d;p?q", false, "http://a/b/c/g;x?y" },
+        { ".", "http://a/b/c/d;p?q", false, "http://a/b/c" },
+        { "./", "http://a/b/c/d;p?q", false, "http://a/b/c" },
+        { "..", "http://a/b/c/d;p?q", false, "http://a/b" },
+        { "../", "http://a/b/c/d;p?q", false, "http://a/b" },
+        { "../g", "http://a/b/c/d;p?q", false, "http://a/b/g" },
+        { "../..", "http://a/b/c/d;p?q", false, "http://a" },
+        { "../../g", "http://a/b/c/d;p?q", false, "http://a/g" },
+        { "../../../g", "http://a/b/c/d;p?q", false, "http://a/g" },
+        { "/./g", "http://a/b/c/d;p?q", false, "http://a/g" },
+        { "/../g", "http://a/b/c/d;p?q", false, "http://a/g" },
+        { "g.", "http://a/b/c/d;p?q", false, "http://a/b/c/g." },
+        { "..g", "http://a/b/c/d;p?q", false, "http://a/b/c/..g" },
+        { "./../g", "http://a/b/c/d;p?q", false, "http://a/b/g" },
+        { "./g/.", "http://a/b/c/d;p?q", false, "http://a/b/c/g" },
+        { "g/./h", "http://a/b/c/d;p?q", false, "http://a/b/c/g/h" },
+        { "g/../h", "http://a/b/c/d;p?q", false, "http://a/b/c/h" },
+        { "http:g", "http://a/b/c/d;p?q", false, "http://a/b/c/g" },
+        // Crawler specific cases
+        { "", "http://a/b", false, "" },
+        { "javascript:void(0)", "http://a/b", false, "" },
+        { "JavaScript:go()", "http://a/b", false, "" },
+        { "mailto:me@site.com", "http://a/b", false, "" },
+        { "data:image/png;base64,AAAA", "http://a/b", true, "" },
+        { "tel:+33123456789", "http://a/b", false, "" },
+        { "HTTPS://WWW.Site.COM:443/Path/./To/../Page.html", "http://a/b", false, "https://www.site.com/Path/Page.html" },
+        { "http://www.site.com:80/", "http://a/b", false, "http://www.site.com" },
+        { "http://www.site.com:8080/x", "http://a/b", false, "http://www.site.com:8080/x" },
+        { "//cdn.site.com/img/a.jpg?w=200", "https://www.site.com/page", true, "https://cdn.site.com/img/a.jpg" },
+        { "img/a.jpg?w=200#top", "https://www.site.com/dir/page?id=1/2", true, "https://www.site.com/dir/img/a.jpg" },
+        { "page 2.html", "https://www.site.com/dir/", false, "https://www.site.com/dir/page%202.html" },
+        { "www.site.fr", "https://www.other.com/dir/page", false, "https://www.site.fr" },
+        { "script.pl?x=1", "http://h/d/", false, "http://h/d/script.pl?x=1" },
+        { "readme.md#intro", "http://h/d/", false, "http://h/d/readme.md" },
+        { "index.php", "https://www.site.com/dir/page", false, "https://www.site.com/dir/index.php" },
+        { "a", "https://www.site.com", false, "https://www.site.com/a" },
+        { "/a", "ftp://www.site.com/b", false, "" },
+    };
+    size_t nb_failures = 0;
+    for (auto& test : cases) {
+        const std::string result = get_abs_url(test.link, test.base, test.for_image);
+        if (result != test.expected) {
+            std::cout << "FAILED: \"" << test.link << "\" + \"" << test.base << "\" -> \"" << result << "\" (expected \"" << test.expected << "\")" << std::endl;
+            nb_failures++;
+        }
+    }
+    std::cout << (sizeof(cases) / sizeof(cases[0]) - nb_failures) << "/" << (sizeof(cases) / sizeof(cases[0])) << " URL resolution cases passed" << std::endl;
+
+    const size_t nb_rounds = 2000;
+    for (int method = 0; method < 2; ++method) {
+        size_t total_length = 0;
+        ElapsedTime timer;
+        for (size_t round = 0; round < (method == 0 ? nb_rounds / 20 : nb_rounds); ++round) {
+            for (auto& test : cases) {
+                if (test.link[0] == '\0') continue; // The previous resolver reads link[0]
+                total_length += (method == 0 ? get_abs_url_legacy(test.link, test.base, test.for_image) : get_abs_url(test.link, test.base, test.for_image)).size();
+            }
+        }
+        const double calls = (method == 0 ? nb_rounds / 20 : nb_rounds) * (sizeof(cases) / sizeof(cases[0]) - 1.0);
+        std::cout << (method == 0 ? "regex resolver: " : "new resolver: ") << std::fixed << std::setprecision(1) << (std::max<long long>(1, timer.getMilliseconds()) * 1000000.0 / calls) << " ns/call" << std::defaultfloat << " (" << total_length << ")" << std::endl;
+    }
 }
 
+// Previous text normalization (one regex and one locale call per character), kept as the reference of the text benchmark
 std::string remove_spaces(const std::string& str) {
     // Use regex_replace to replace all occurrences of the pattern with a single space
     return boost::regex_replace(str, boost::regex(std::string("\\s+")), " ");
@@ -185,9 +4126,9 @@ std::unordered_set<std::string> stop_words = {
     "ovunque", "altrove", "addirittura", "sempre", "gi", "appena", "proprio",
     "nient", "altro", "nulla", "qualcosa", "qualcuno", "tutt", "solamente", "it"
 };
-boost::locale::generator gen;
-std::locale loc = gen("");
 std::string replace_non_iso_ascii_chars(const std::string& input) {
+    static boost::locale::generator gen;
+    static std::locale loc = gen("");
     std::string output;
     for (const auto& ch : input) {
         if (ch < 0 || ch > 127) {
@@ -200,7 +4141,7 @@ std::string replace_non_iso_ascii_chars(const std::string& input) {
     }
     return output;
 }
-void remove_stop_words(std::string& input) {
+void remove_stop_words_legacy(std::string& input) {
     std::string stripped = replace_non_iso_ascii_chars(input);
     std::vector<std::string> words;
     boost::split(words, stripped, boost::is_any_of(" .,:;!?#@[]{}|\"&")); // Split the input string into individual words
@@ -209,566 +4150,474 @@ void remove_stop_words(std::string& input) {
             return stop_words.find(word) != stop_words.end();
         }), words.end()); // Erase stop words from the vector
     input = remove_spaces(boost::join(words, " ")); // Join the remaining words back into a string
+    if (input.length() > max_str_length) {
+        size_t space_pos = input.find(' ', max_str_length);
+        if (space_pos != std::string::npos) input = input.substr(0, space_pos);
+        else input = input.substr(0, max_str_length);
+    }
+    boost::algorithm::trim(input);
+}
+// Benchmark the text normalization on real samples: one text per line of a file, or the alt and surrounding texts of the database
+void bench_text(const std::string& path) {
+    std::vector<std::string> samples;
+    if (!path.empty()) {
+        std::ifstream file(path);
+        std::string line;
+        while (std::getline(file, line)) if (!line.empty()) samples.push_back(line);
+    }
+    else {
+        try {
+            for (auto& img : storage.iterate<ImageData>()) {
+                if (img.alt && !img.alt->empty()) samples.push_back(*img.alt);
+                if (img.surrounding_text && !img.surrounding_text->empty()) samples.push_back(*img.surrounding_text);
+                if (samples.size() >= 200000) break;
+            }
+        }
+        catch (const std::exception& e) {
+            std::cerr << "Error reading samples: " << e.what() << std::endl;
+        }
+    }
+    size_t total_bytes = 0;
+    for (auto& sample : samples) total_bytes += sample.size();
+    std::cout << "Normalizing " << samples.size() << " texts (" << total_bytes << " bytes)" << std::endl;
+    if (samples.empty()) return;
+    for (int method = 0; method < 2; ++method) {
+        size_t total_length = 0;
+        ElapsedTime timer;
+        for (auto& sample : samples) {
+            std::string text = sample;
+            if (method == 0) remove_stop_words_legacy(text);
+            else remove_stop_words(text);
+            total_length += text.size();
+        }
+        const double seconds = std::max<long long>(1, timer.getMilliseconds()) / 1000.0;
+        std::cout << (method == 0 ? "legacy normalization: " : "single pass normalization: ") << std::fixed << std::setprecision(1) << (samples.size() / seconds) << " texts/sec, " << (total_bytes / seconds / (1024 * 1024)) << " MB/s" << std::defaultfloat << " (" << total_length << ")" << std::endl;
+    }
 }
 
-std::string get_abs_url(const std::string& link, const std::string& base_url, const bool for_image) {
-    std::string abs_url("");
-    std::regex js_regex("(javascript:|data:image/|mailto:)", std::regex_constants::icase);
-    if (std::regex_search(link, js_regex)) return abs_url;
+// Compare the streaming extractor with the Gumbo walk on the HTML files of a folder, and time both of them
+void diff_extract(const boost::filesystem::path& folder) {
+    std::vector<std::pair<std::string, std::string>> pages;
+    for (boost::filesystem::directory_iterator it(folder), end; it != end; ++it) {
+        const std::string extension = boost::algorithm::to_lower_copy(it->path().extension().string());
+        if (!boost::filesystem::is_regular_file(*it) || (extension != ".html" && extension != ".htm")) continue;
+        std::ifstream file(it->path().string(), std::ios::in | std::ios::binary);
+        std::string html((std::istreambuf_iterator<char>(file)), std::istreambuf_iterator<char>());
+        if (html.size() > max_html_page_size) html.resize(max_html_page_size);
+        pages.emplace_back(it->path().filename().string(), std::move(html));
+    }
+    std::cout << "Comparing the extractors on " << pages.size() << " pages" << std::endl;
 
-    // Check if the link is already an absolute URL
-    std::regex http_regex("^https?://", std::regex_constants::icase);
-    if (std::regex_search(link, http_regex)) return link;
+    size_t nb_identical = 0;
+    long long gumbo_ms = 0, stream_ms = 0;
+    PageExtract gumbo_page, stream_page;
+    for (auto& page : pages) {
+        const std::string base_url = "http://localhost/" + page.first;
+        ElapsedTime timer;
+        GumboOutput* doc = gumbo_parse(page.second.c_str());
+        gumbo_page.clear();
+        if (doc != nullptr) {
+            extract_page(doc->root, base_url, true, gumbo_page);
+            gumbo_destroy_output(&kGumboDefaultOptions, doc);
+        }
+        gumbo_ms += timer.getMilliseconds();
+        timer.reset();
+        extract_page_stream(page.second, base_url, true, stream_page);
+        stream_ms += timer.getMilliseconds();
 
-    // Check if the link starts with a slash, indicating a relative URL    
-    if (link[0] == '/') {
-        std::regex base_http_regex("^https?://[^/]+", std::regex_constants::icase);
-        std::smatch base_match;
-        if (std::regex_search(base_url, base_match, base_http_regex)) {
-            std::string base_domain = base_match[0];
-            abs_url = base_domain + link;
+        // Report the first difference of each kind
+        std::vector<std::string> differences;
+        std::string gumbo_title = gumbo_page.title.empty() ? gumbo_page.h1 : gumbo_page.title, stream_title = stream_page.title.empty() ? stream_page.h1 : stream_page.title;
+        remove_stop_words(gumbo_title);
+        remove_stop_words(stream_title);
+        if (gumbo_title != stream_title) differences.push_back("title: \"" + gumbo_title + "\" / \"" + stream_title + "\"");
+        if (gumbo_page.links != stream_page.links) {
+            size_t i = 0;
+            while (i < gumbo_page.links.size() && i < stream_page.links.size() && gumbo_page.links[i] == stream_page.links[i]) ++i;
+            differences.push_back("links: " + std::to_string(gumbo_page.links.size()) + " / " + std::to_string(stream_page.links.size()) + ", first difference at #" + std::to_string(i) + ": \"" +
+                (i < gumbo_page.links.size() ? gumbo_page.links[i] : "") + "\" / \"" + (i < stream_page.links.size() ? stream_page.links[i] : "") + "\"");
+        }
+        if (gumbo_page.images.size() != stream_page.images.size()) {
+            differences.push_back("images: " + std::to_string(gumbo_page.images.size()) + " / " + std::to_string(stream_page.images.size()));
+        }
+        else {
+            for (size_t i = 0; i < gumbo_page.images.size(); ++i) {
+                const PageExtract::Image& a = gumbo_page.images[i], & b = stream_page.images[i];
+                if (a.url != b.url) differences.push_back("image #" + std::to_string(i) + " url: \"" + a.url + "\" / \"" + b.url + "\"");
+                else if (a.alt != b.alt) differences.push_back("image #" + std::to_string(i) + " alt: \"" + a.alt + "\" / \"" + b.alt + "\"");
+                else if (a.surrounding != b.surrounding) differences.push_back("image #" + std::to_string(i) + " surrounding: \"" + a.surrounding + "\" / \"" + b.surrounding + "\"");
+                else continue;
+                break;
+            }
+        }
+        if (differences.empty()) {
+            nb_identical++;
+            continue;
         }
+        std::cout << page.first << " (gumbo / stream):" << std::endl;
+        for (auto& difference : differences) std::cout << "    " << difference << std::endl;
     }
-    else { // Otherwise, assume the link is a relative URL
-        std::string base_dir = base_url.substr(0, base_url.find_last_of('/') + 1);
-        abs_url = base_dir + link;
+    std::cout << nb_identical << "/" << pages.size() << " pages extracted identically" << std::endl;
+    std::cout << "gumbo: " << gumbo_ms << " ms - stream: " << stream_ms << " ms" << std::endl;
+}
 
-        // Test if the link starts with a domain name
-        std::regex domain_regex("^[^/]+\\.(com|org|net|edu|gov|mil|biz|info|name|museum|us|ca|uk|fr|de|jp|ru|cn|es|it|au|nz|ch|nl|be|se|no|fi|dk|at|gr|ie|pl|pt|cz|ro|hu|sk|hr|bg|rs|lv|lt|ee|is|cy|lu|mt|md|al|ad|li|mc|sm|va|by|ua|kz|uz|tm|kg|ge|am|az|tr|il|in|ae|sa|ir|kw|bh|qa|om|ye|ps|lb|jo|sy|iq|eg|ly|dz|ma|tn|sd|er|so|ke|et|dj|ug|bi|rw|mg|mu|sc|za|na|bw|zw|zm|sz|ls|mw|sz|gq|ga|st|cv|td|km|so|cg|ci|lr|sl|gh|ng|cm|cf|tn|mr|sn|gn|gw|tg|bf|ne|mg|mu|re|yt|tf|nf|aq|hm|bv|gs)$", std::regex_constants::icase);
-        if (std::regex_search(link, domain_regex)) {
-            // Prepend the protocol to the domain name
-            std::regex base_http_regex("^https?://", std::regex_constants::icase);
-            std::smatch base_match;
-            if (std::regex_search(base_url, base_match, base_http_regex)) {
-                std::string protocol = base_match[0];
-                abs_url = protocol + link;
+// Parse the HTML files of a folder with several threads and report the throughput and the peak memory.
+// Run it once with and once without --no-parse-arena, the peak working set being a process wide value
+void bench_parse(const boost::filesystem::path& folder, const size_t num_threads) {
+    std::vector<std::string> pages;
+    for (boost::filesystem::directory_iterator it(folder), end; it != end; ++it) {
+        const std::string extension = boost::algorithm::to_lower_copy(it->path().extension().string());
+        if (!boost::filesystem::is_regular_file(*it) || (extension != ".html" && extension != ".htm")) continue;
+        std::ifstream file(it->path().string(), std::ios::in | std::ios::binary);
+        pages.emplace_back((std::istreambuf_iterator<char>(file)), std::istreambuf_iterator<char>());
+        if (pages.back().size() > max_html_page_size) pages.back().resize(max_html_page_size);
+    }
+    if (pages.empty()) return;
+    const size_t nb_rounds = 20, nb_parses = pages.size() * nb_rounds;
+    std::cout << "Parsing " << pages.size() << " pages " << nb_rounds << " times with " << num_threads << " threads " << (use_parse_arena ? "with" : "without") << " the parse arenas" << std::endl;
+    std::atomic<size_t> next_parse = 0, nb_links = 0;
+    ElapsedTime timer;
+    std::vector<std::thread> threads;
+    for (size_t i = 0; i < num_threads; ++i) {
+        threads.emplace_back([&]() {
+            PageExtract page;
+            for (size_t n = next_parse++; n < nb_parses; n = next_parse++) {
+                GumboOutput* doc = parse_page_tree(pages[n % pages.size()]);
+                if (doc != nullptr) extract_page(doc->root, "http://localhost/", true, page);
+                release_page_tree(doc);
+                nb_links += page.links.size();
             }
-        }        
+        });
     }
-    // Remove any query string or fragment identifier
-    abs_url = abs_url.substr(0, abs_url.find_first_of(for_image ? "?#" : "#"));
-    if (abs_url.back() == '/') abs_url.pop_back();
-    boost::replace_all(abs_url, " ", "%20");
-    return (abs_url.size() < max_url_length ? abs_url : "");
+    for (auto& thread : threads) thread.join();
+    const double seconds = std::max<long long>(1, timer.getMilliseconds()) / 1000.0;
+    std::cout << std::fixed << std::setprecision(1) << (nb_parses / seconds) << " pages/sec - peak RSS: " << get_peak_memory_mb() << " MB" << std::defaultfloat << " (" << nb_links << " links)" << std::endl;
 }
 
-std::string get_first_h1_text(const GumboNode* root) {
-    std::string text = "";
-    if (root != nullptr && root->type == GUMBO_NODE_ELEMENT) {
-        if (root->v.element.tag == GUMBO_TAG_H1) {
-            const GumboVector* children = &root->v.element.children;
-            if (children != nullptr && children->length > 0) {
-                const GumboNode* child = static_cast<const GumboNode*>(children->data[0]);
-                if (child != nullptr && child->type == GUMBO_NODE_TEXT && child->v.text.text != nullptr) text = child->v.text.text;
-            }
-        }
-        else {
-            const GumboVector* children = &root->v.element.children;
-            if (children != nullptr) {
-                for (unsigned int i = 0; i < children->length; ++i) {
-                    const GumboNode* text_node = static_cast<const GumboNode*>(children->data[i]);
-                    if (text_node != nullptr) {
-                        const std::string child_text = get_first_h1_text(text_node);
-                        if (!child_text.empty()) {
-                            text = child_text;
-                            break;
-                        }
-                    }
-                }
-            }
-        }
+// Compare the image resize throughput of the dlib path and the fast path on the JPEG files of a folder
+void bench_resize(const boost::filesystem::path& folder) {
+    std::vector<std::string> images;
+    for (boost::filesystem::directory_iterator it(folder), end; it != end; ++it) {
+        if (!boost::filesystem::is_regular_file(*it) || it->path().extension() != ".jpg") continue;
+        std::ifstream file(it->path().string(), std::ios::in | std::ios::binary);
+        images.emplace_back((std::istreambuf_iterator<char>(file)), std::istreambuf_iterator<char>());
     }
-    return text;
-}
-
-std::string get_page_title(const GumboNode* root) {
-    std::string title = "";
-    bool found_head = false;
-    const GumboVector* children = &root->v.element.children;
-    if (children == nullptr) return title;
-    for (unsigned int i = 0; i < children->length; ++i) {
-        const GumboNode* child = static_cast<const GumboNode*>(children->data[i]);
-        if (child != nullptr && child->type == GUMBO_NODE_ELEMENT && child->v.element.tag == GUMBO_TAG_HEAD) {
-            found_head = true;
-            const GumboVector* head_children = &child->v.element.children;
-            if (head_children != nullptr) {
-                for (unsigned int j = 0; j < head_children->length; ++j) {
-                    const GumboNode* title_node = static_cast<const GumboNode*>(head_children->data[j]);
-                    if (title_node != nullptr && title_node->type == GUMBO_NODE_ELEMENT && title_node->v.element.tag == GUMBO_TAG_TITLE) {
-                        const GumboVector* title_children = &title_node->v.element.children;
-                        if (title_children != nullptr && title_children->length > 0) {
-                            const GumboNode* text_node = static_cast<const GumboNode*>(title_children->data[0]);
-                            if (text_node != nullptr && text_node->type == GUMBO_NODE_TEXT && text_node->v.text.text != nullptr) {
-                                title = text_node->v.text.text;
-                                break;
-                            }
-                        }
-                    }
+    const std::string filename = (boost::filesystem::temp_directory_path() / "ffspider_bench.jpg").string();
+    std::cout << "Resizing " << images.size() << " images to at most " << max_image_dims << " pixels" << std::endl;
+    for (int method = 0; method < 2; ++method) {
+        size_t nb_resized = 0;
+        ElapsedTime timer;
+        for (auto& bytes : images) {
+            size_t width, height, components;
+            if (!probe_image_dims(bytes, "jpg", width, height, components)) continue;
+            if (width <= max_image_dims && height <= max_image_dims) continue;
+            try {
+                if (method == 0) {
+                    dlib::array2d<dlib::rgb_pixel> img;
+                    dlib::load_jpeg(img, reinterpret_cast<const unsigned char*>(bytes.data()), bytes.size());
+                    size_t new_width, new_height;
+                    get_resized_dims(width, height, new_width, new_height);
+                    dlib::array2d<dlib::rgb_pixel> size_img(new_height, new_width);
+                    dlib::resize_image(img, size_img);
+                    dlib::save_jpeg(size_img, filename, 90);
+                }
+                else {
+                    resize_image_fast(bytes, "jpg", width, height, filename);
                 }
+                nb_resized++;
+            }
+            catch (std::exception& e) {
+                std::cerr << "Error resizing image: " << e.what() << std::endl;
             }
         }
-        if (found_head) break;
+        const double seconds = std::max<long long>(1, timer.getMilliseconds()) / 1000.0;
+        std::cout << (method == 0 ? "dlib path: " : "fast path: ") << nb_resized << " images in " << seconds << " s - " << std::fixed << std::setprecision(1) << (nb_resized / seconds) << " images/sec" << std::defaultfloat << std::endl;
     }
-    return title;
-}
-
-// Helper function to extract image links from a page and download source images
-std::string calculate_md5_from_path(boost::filesystem::path& p) {
-    std::string file_name = p.filename().string();
-    std::string sub_folder_name = p.parent_path().filename().string();
-    std::string top_folder_name = p.parent_path().parent_path().filename().string();
-    return (top_folder_name + sub_folder_name + file_name.substr(0, file_name.find_last_of('.')));
+    boost::system::error_code ec;
+    boost::filesystem::remove(filename, ec);
 }
-void get_file_folder(const std::string& md5_hash, std::string& folder_pathname) {
-    // Split the MD5 hash into two parts: the first 2 characters and the remaining characters
-    std::string top_folder_name = md5_hash.substr(0, 1);
-    std::string sub_folder_name = md5_hash.substr(1, 1);
-    std::string file_name = md5_hash.substr(2);
 
-    // Construct the destination folder path based on the top folder name and subfolder name
-    folder_pathname = boost::filesystem::current_path().string() + "/img_cache";
-    if (!boost::filesystem::exists(folder_pathname)) boost::filesystem::create_directory(folder_pathname);
-    folder_pathname += "/" + top_folder_name;
-    if (!boost::filesystem::exists(folder_pathname)) boost::filesystem::create_directory(folder_pathname);
-    folder_pathname += "/" + sub_folder_name;
-    if (!boost::filesystem::exists(folder_pathname)) boost::filesystem::create_directory(folder_pathname);
-    folder_pathname += "/" + file_name + ".jpg";
-}
-bool download_image(cpr::Session& session, const std::string& url, const std::string& filename, size_t& file_size, size_t& width, size_t& height, std::string& file_type) {            
-    auto ouput_file = std::ofstream(filename, std::ios::out | std::ios::binary | std::ios::trunc);
-    if (!ouput_file.is_open()) return false;
-    try {
-        session.SetUrl(cpr::Url{ url });
-        auto r = session.Download(ouput_file);
-        ouput_file.flush(); // Flush data on-disk before continuing
-        ouput_file.close();
-        if (r.status_code != 200) {
-            if (verbose) std::cerr << "Error downloading image from " << url << " - " << r.status_code << " " << r.error.message << std::endl;
-            boost::filesystem::remove(filename);
+// Local stand-in of the web for the crawl benchmark: a generated graph of pages spread over several loopback hosts,
+// with their images, served over HTTP/1.1 keep-alive connections. Everything is deterministic, so that two runs crawl the same site
+class SyntheticSite {
+public:
+    struct Options {
+        size_t pages = 2000, fanout = 10, page_size = 20000, images = 4, image_size = 480, hosts = 8, latency_ms = 0;
+        std::string image_format = "jpg";
+        double error_rate = 0.0;
+    };
+    bool start(const Options& options) {
+        m_options = options;
+        m_options.pages = std::max<size_t>(1, m_options.pages);
+        m_options.hosts = std::min<size_t>(250, std::max<size_t>(1, m_options.hosts));
+        if (!generate_images()) return false;
+        uint64_t state = 1;
+        for (size_t i = 0; i < 2000; ++i) {
+            std::string word;
+            for (size_t n = 2 + next_random(state) % 8; n > 0; --n) word += static_cast<char>('a' + next_random(state) % 26);
+            m_words.push_back(std::move(word));
+        }
+        try {
+            unsigned short port = 0; // Same port on every host, the first one picks it
+            for (size_t i = 0; i < m_options.hosts; ++i) {
+                m_acceptors.push_back(std::make_unique<boost::asio::ip::tcp::acceptor>(m_io, boost::asio::ip::tcp::endpoint(boost::asio::ip::make_address_v4(get_host(i)), port)));
+                port = m_acceptors.back()->local_endpoint().port();
+            }
+            m_port = port;
+        }
+        catch (std::exception& e) {
+            std::cerr << "Unable to start the synthetic site - " << e.what() << std::endl;
             return false;
         }
+        for (auto& acceptor : m_acceptors) accept(*acceptor);
+        m_start_time = std::chrono::steady_clock::now();
+        m_last_activity = m_start_time.time_since_epoch().count();
+        for (size_t i = 0; i < synthetic_site_threads; ++i) m_threads.emplace_back([this]() { m_io.run(); });
+        return true;
     }
-    catch (...) {
-        ouput_file.flush(); // Flush data on-disk before continuing
-        ouput_file.close();
-        if (verbose) std::cerr << "Error downloading image from " << url << std::endl;
-        boost::filesystem::remove(filename);
-        return false;
-    }
-
-    // Get image file size in bytes, also check its type
-    std::ifstream file(filename, std::ios::in | std::ios::binary);
-    if (!file) {
-        if (verbose) std::cerr << "Error opening image file: " << filename << std::endl;
-        boost::filesystem::remove(filename);
-        return false;
-    }
-    file.seekg(0, std::ios::end);
-    file_size = file.tellg();
-    file.seekg(0, std::ios::beg);
-    if (file_size < min_image_file_size || file_size > max_image_file_size) {
-        file.close();
-        if (verbose) std::cerr << "Too small or large image file: " << filename << " (" << file_size << " bytes)" << std::endl;
-        boost::filesystem::remove(filename);
-        return false;
+    void stop() {
+        m_io.stop();
+        for (auto& thread : m_threads) thread.join();
+        m_threads.clear();
     }
-    std::vector<char> data(std::min<std::size_t>(file_size, 10));
-    if (!file.read(&data[0], data.size())) {
-        file.close();
-        if (verbose) std::cerr << "Error reading image file: " << filename << std::endl;
-        boost::filesystem::remove(filename);
-        return false;
+    const Options& options() const { return m_options; }
+    std::string start_url() const { return get_page_url(0); }
+    size_t pages_served() const { return m_pages_served; }
+    size_t images_served() const { return m_images_served; }
+    size_t errors_served() const { return m_errors_served; }
+    size_t bytes_served() const { return m_bytes_served; }
+    // Time from the start to the last response
+    double active_seconds() const {
+        const auto last = std::chrono::steady_clock::time_point(std::chrono::steady_clock::duration(m_last_activity.load()));
+        return std::max(0.001, std::chrono::duration<double>(last - m_start_time).count());
     }
-    file.close();
-    if (data[0] == (char)0xFF && data[1] == (char)0xD8) file_type = "jpg";
-    /* else if (data[0] == (char)0x47 && data[1] == (char)0x49 && data[2] == (char)0x46) file_type = "gif"; */
-    else if (data[0] == (char)0x89 && data[1] == (char)0x50 && data[2] == (char)0x4E && data[3] == (char)0x47 &&
-        data[4] == (char)0x0D && data[5] == (char)0x0A && data[6] == (char)0x1A && data[7] == (char)0x0A) file_type = "png";
-    else {
-        if (verbose) std::cerr << "Unsupported file type for image " << url << std::endl;
-        boost::filesystem::remove(filename);
-        return false;
+    // No request in progress nor received for a while
+    bool idle_for(const std::chrono::milliseconds& window) const {
+        const auto last = std::chrono::steady_clock::time_point(std::chrono::steady_clock::duration(m_last_activity.load()));
+        return m_in_flight == 0 && std::chrono::steady_clock::now() - last >= window;
     }
 
-    // Extract real dimensions and resize if required
-    try {        
-        dlib::array2d<dlib::rgb_pixel> img;
-        dlib::load_image(img, filename);
-        width = img.nc();
-        height = img.nr();
-        if (width > max_image_dims || height > max_image_dims) {
-            const double resize_factor = std::min(max_image_dims / (double)width, max_image_dims / (double)height);
-            const size_t new_width = static_cast<size_t>(width * resize_factor);
-            const size_t new_height = static_cast<size_t>(height * resize_factor);
-            dlib::array2d<dlib::rgb_pixel> size_img(new_height, new_width);
-            dlib::resize_image(img, size_img);
-            dlib::save_jpeg(size_img, filename, 90);
+private:
+    // One client connection, answering its requests in sequence
+    class Session : public std::enable_shared_from_this<Session> {
+    public:
+        Session(SyntheticSite& site, boost::asio::ip::tcp::socket socket) : m_site(site), m_socket(std::move(socket)), m_timer(m_socket.get_executor()) {}
+        void read() {
+            auto self = shared_from_this();
+            boost::asio::async_read_until(m_socket, m_request, "\r\n\r\n", [this, self](const boost::system::error_code& ec, size_t size) {
+                if (ec) return;
+                const std::string head(boost::asio::buffers_begin(m_request.data()), boost::asio::buffers_begin(m_request.data()) + size);
+                m_request.consume(size);
+                m_site.m_in_flight++;
+                m_site.respond(head, m_response, m_keep_alive);
+                if (m_site.m_options.latency_ms == 0) {
+                    write();
+                    return;
+                }
+                m_timer.expires_after(std::chrono::milliseconds(m_site.m_options.latency_ms));
+                m_timer.async_wait([this, self](const boost::system::error_code&) { write(); });
+                });
         }
-        else {
-            dlib::save_jpeg(img, filename, 90);
+
+    private:
+        void write() {
+            auto self = shared_from_this();
+            boost::asio::async_write(m_socket, boost::asio::buffer(m_response), [this, self](const boost::system::error_code& ec, size_t size) {
+                m_site.m_bytes_served += size;
+                m_site.m_last_activity = std::chrono::steady_clock::now().time_since_epoch().count();
+                m_site.m_in_flight--;
+                if (!ec && m_keep_alive) read();
+                });
         }
+        SyntheticSite& m_site;
+        boost::asio::ip::tcp::socket m_socket;
+        boost::asio::steady_timer m_timer;
+        boost::asio::streambuf m_request;
+        std::string m_response;
+        bool m_keep_alive = true;
+    };
+
+    void accept(boost::asio::ip::tcp::acceptor& acceptor) {
+        acceptor.async_accept([this, &acceptor](const boost::system::error_code& ec, boost::asio::ip::tcp::socket socket) {
+            if (!ec) std::make_shared<Session>(*this, std::move(socket))->read();
+            accept(acceptor);
+            });
     }
-    catch (std::exception& e) {
-        if (verbose) std::cerr << "Error processing image file: " << filename << " - " << e.what() << std::endl;
-        boost::filesystem::remove(filename);
-        return false;
+    static uint64_t next_random(uint64_t& state) {
+        uint64_t z = (state += 0x9e3779b97f4a7c15ULL);
+        z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ULL;
+        z = (z ^ (z >> 27)) * 0x94d049bb133111ebULL;
+        return z ^ (z >> 31);
     }
-
-    return true;
-}
-
-void extract_image_links(const GumboNode* root_node, const std::string& base_url, const std::string& title) {
-    cpr::Session session;
-    session.SetUserAgent(cpr::UserAgent{ user_agent });
-    session.SetHeader(cpr::Header{ {"Accept", "image/png, image/jpeg"} });
-    session.SetConnectTimeout(cpr::ConnectTimeout{ 2500 });
-    session.SetTimeout(cpr::Timeout{ 8500 });
-
-    std::vector<GumboNode*> nodes;
-    nodes.push_back((GumboNode*)root_node);
-
-    while (!nodes.empty()) {
-        GumboNode* node = nodes.back();
-        nodes.pop_back();
-        if (node == nullptr || (node->type != GUMBO_NODE_ELEMENT && node->type != GUMBO_NODE_DOCUMENT)) continue;
-        if (node->v.element.tag == GUMBO_TAG_IMG) {
-            GumboAttribute* src_attr = gumbo_get_attribute(&node->v.element.attributes, "src");
-            GumboAttribute* alt_attr = gumbo_get_attribute(&node->v.element.attributes, "alt");
-            if (src_attr) {
-                std::string src_url = get_abs_url(src_attr->value, base_url, true), surrounding("");
-                if (src_url.find("http") == 0) {  // Check if absolute URL                    
-                    std::string alt = alt_attr ? alt_attr->value : std::string("");
-                    if (!alt.empty()) {
-                        remove_stop_words(alt);
-                        if(alt.length() > max_str_length) {
-                            size_t space_pos = alt.find(' ', max_str_length);
-                            if (space_pos != std::string::npos) alt = alt.substr(0, space_pos);
-                            else alt = alt.substr(0, max_str_length);
-                        }
-                        boost::algorithm::trim(alt);
-                    }
-
-                    // Collect text nodes before and after the image
-                    GumboNode* parent = node->parent;
-                    if (parent != nullptr && parent->type == GUMBO_NODE_ELEMENT) {
-                        GumboVector* children = &parent->v.element.children;
-                        if (children != nullptr) {
-                            int j;
-                            for (unsigned int i = 0; i < children->length; ++i) {
-                                if (static_cast<GumboNode*>(children->data[i]) == node) { // This is the image node, skip it                                    
-                                    j = i - 1;
-                                    while (j > 0) {
-                                        if ((static_cast<GumboNode*>(children->data[j])) != nullptr && (static_cast<GumboNode*>(children->data[j]))->type == GUMBO_NODE_TEXT && (static_cast<GumboNode*>(children->data[j]))->v.text.text != nullptr) {
-                                            surrounding = (surrounding.empty() ? "" : " ") + std::string((static_cast<GumboNode*>(children->data[j]))->v.text.text);
-                                            break;
-                                        }
-                                        j--;
-                                    }                                    
-                                    j = i + 1;
-                                    while (j < static_cast<int>(children->length)) {
-                                        if ((static_cast<GumboNode*>(children->data[j])) != nullptr && (static_cast<GumboNode*>(children->data[j]))->type == GUMBO_NODE_TEXT && (static_cast<GumboNode*>(children->data[j]))->v.text.text != nullptr) {
-                                            surrounding = (surrounding.empty() ? "" : " ") + std::string((static_cast<GumboNode*>(children->data[j]))->v.text.text);
-                                            break;
-                                        }
-                                        j++;
-                                    }
-                                    break;
-                                }
-                            }
-                        }
-                    }
-                    if (!title.empty()) surrounding = title + " " + surrounding;                    
-                    if (!surrounding.empty()) remove_stop_words(surrounding);
-                    if (surrounding.length() > max_str_length) {
-                        size_t space_pos = surrounding.find(' ', max_str_length);
-                        if (space_pos != std::string::npos) {
-                            surrounding = surrounding.substr(0, space_pos);
-                        }
-                        else {
-                            surrounding = surrounding.substr(0, max_str_length);
-                        }
-                    }
-                    boost::algorithm::trim(surrounding);
-                    std::string last_seen = get_current_time();
-
-                    size_t file_size = 0, width = 0, height = 0;
-                    std::string mime("");
-                    
-                    ImageData data{ src_url, std::make_unique<std::string>(""), base_url, std::make_unique<std::string>(""), file_size, width, height, std::make_unique<std::string>(mime), last_seen};
-                    bool is_new_image = false;
-                    std::unique_lock<std::mutex> lck(mtx);
-                    try {
-                        memory_storage.insert(data);
-                        total_images++;
-                        if (verbose) std::cout << "url: " << src_url << " - src: " << base_url << " - alt: " << alt << " - surrounding: " << surrounding << " - last_seen: " << last_seen << std::endl;
-                        is_new_image = true;
-                    }
-                    catch (std::system_error e) {
-                        std::string error_msg = e.what();
-                        if (error_msg.find("UNIQUE constraint failed") != std::string::npos) {
-                            memory_storage.update_all(set(c(&ImageData::last_seen) = last_seen),
-                                where(c(&ImageData::url) == src_url));
-                         }
-                         else {
-                             if (verbose) std::cout << error_msg << std::endl;
-                         }
-                    }
-                    catch (...) {
-                        if (verbose) std::cout << "unknown exeption" << std::endl;
-                    }
-                    lck.unlock();
-                    if (is_new_image) { // Only download image if not already present into the database                        
-                        size_t md5_as_int = boost::hash<std::string>{}(src_url); // Calculate the MD5 hash of the string
-                        std::stringstream ss;
-                        ss << std::hex << std::setw(16) << std::setfill('0') << md5_as_int;
-                        std::string filename, md5_as_str = ss.str();
-                        get_file_folder(md5_as_str, filename);
-
-                        if (download_image(session, src_url, filename, file_size, width, height, mime)) {
-                            lck.lock();                            
-                            memory_storage.update_all(set(c(&ImageData::alt) = std::make_unique<std::string>(alt),
-                                c(&ImageData::surrounding_text) = std::make_unique<std::string>(surrounding),
-                                c(&ImageData::file_size) = file_size,
-                                c(&ImageData::width) = width,
-                                c(&ImageData::height) = height,
-                                c(&ImageData::mime) = std::make_unique<std::string>(mime)),
-                                where(c(&ImageData::url) == src_url));                            
-                            lck.unlock();
-                        }
-                        else {
-                            lck.lock();
-                            memory_storage.update_all(set(c(&ImageData::mime) = unsupported_image_mime), where(c(&ImageData::url) == src_url));
-                            lck.unlock();
-                        }
-                    }
-                }
+    static std::string get_host(const size_t index) { return "127.0.0." + std::to_string(1 + index); }
+    std::string get_page_url(const size_t id) const { return "http://" + get_host(id % m_options.hosts) + ":" + std::to_string(m_port) + "/page/" + std::to_string(id); }
+    std::string get_image_url(const size_t page_id, const size_t id) const {
+        return "http://" + get_host(page_id % m_options.hosts) + ":" + std::to_string(m_port) + "/img/" + std::to_string(id) + "." + m_images[id % m_images.size()].first;
+    }
+    // Random blocks of color over a gradient: every image of the pool has its own perceptual hash.
+    // Beyond the pool, the images repeat its contents and go through the deduplication
+    bool generate_images() {
+        const size_t width = std::max<size_t>(16, m_options.image_size), height = std::max<size_t>(16, width * 3 / 4);
+        const boost::filesystem::path png_file = boost::filesystem::temp_directory_path() / "ffspider_site.png";
+        uint64_t state = 42;
+        dlib::array2d<dlib::rgb_pixel> img(height, width);
+        for (size_t k = 0; k < synthetic_image_pool; ++k) {
+            std::array<dlib::rgb_pixel, 48> blocks;
+            for (auto& block : blocks) {
+                const uint64_t color = next_random(state);
+                block = dlib::rgb_pixel(color & 0xDF, (color >> 8) & 0xDF, (color >> 16) & 0xDF);
             }
-        }
-        // Add all child nodes to the vector
-        GumboVector* children = &node->v.element.children;
-        if (children != nullptr) {
-            for (unsigned int i = 0; i < children->length; ++i) {
-                nodes.push_back(static_cast<GumboNode*>(children->data[i]));
+            for (size_t r = 0; r < height; ++r) {
+                for (size_t c = 0; c < width; ++c) {
+                    const dlib::rgb_pixel& block = blocks[(r * 6 / height) * 8 + c * 8 / width];
+                    const unsigned char shade = static_cast<unsigned char>((r + c) & 31);
+                    img[r][c] = dlib::rgb_pixel(block.red + shade, block.green + shade, block.blue + shade);
+                }
             }
-        }
-    }
-}
-
-void extract_links(const GumboNode* root_node, const std::string& base_url) {
-    std::vector<GumboNode*> nodes;
-    nodes.push_back((GumboNode*)root_node);
-
-    while (!nodes.empty()) {
-        GumboNode* node = nodes.back();
-        nodes.pop_back();
-        if (node == nullptr || node->type != GUMBO_NODE_ELEMENT) continue;
-        if (node->v.element.tag == GUMBO_TAG_A) {
-            GumboAttribute* href = gumbo_get_attribute(&node->v.element.attributes, "href");
-            if (href != nullptr) {
-                std::string link = href->value;
-                boost::algorithm::trim(link);
-                if (!link.empty()) {
-                    std::string abs_url = get_abs_url(link, base_url, false);
-                    std::string last_crawled(""), last_seen = get_current_time();
-
-                    UrlData data{ abs_url, std::make_unique<std::string>(last_crawled), last_seen, 100 };
-                    std::unique_lock<std::mutex> lck(mtx);
-                    try {
-                        memory_storage.insert(data);
-                        if (verbose) std::cout << "url: " << abs_url << " - last_seen: " << last_seen << std::endl;
-                    }
-                    catch (std::system_error e) {
-                        std::string error_msg = e.what();
-                        if (error_msg.find("UNIQUE constraint failed") != std::string::npos) {
-                            memory_storage.update_all(set(c(&UrlData::last_seen) = last_seen),
-                                where(c(&UrlData::url) == abs_url));
-                        }
-                        else {
-                            if (verbose) std::cout << error_msg << std::endl;
-                        }
-                    }
-                    catch (...) {
-                        if (verbose) std::cout << "unknown exeption" << std::endl;
-                    }
-                    lck.unlock();
+            const bool png = m_options.image_format == "png" || (m_options.image_format == "mixed" && k % 2 == 1);
+            std::string bytes;
+            try {
+                if (png) {
+                    dlib::save_png(img, png_file.string());
+                    std::ifstream file(png_file.string(), std::ios::in | std::ios::binary);
+                    bytes.assign((std::istreambuf_iterator<char>(file)), std::istreambuf_iterator<char>());
+                }
+                else if (!encode_jpeg(img, 85, bytes)) {
+                    bytes.clear();
                 }
             }
-        }
-        // Add all child nodes to the vector
-        GumboVector* children = &node->v.element.children;
-        if (children != nullptr) {
-            for (unsigned int i = 0; i < children->length; ++i) {
-                nodes.push_back(static_cast<GumboNode*>(children->data[i]));
+            catch (std::exception& e) {
+                std::cerr << "Unable to generate the images of the synthetic site - " << e.what() << std::endl;
             }
+            if (bytes.empty()) return false;
+            m_images.emplace_back(png ? "png" : "jpg", std::move(bytes));
         }
+        boost::system::error_code ec;
+        boost::filesystem::remove(png_file, ec);
+        return true;
     }
-}
-
-// Spider function that crawls URLs
-void spider() {
-    cpr::Session session;
-    session.SetUserAgent(cpr::UserAgent{ user_agent });
-    session.SetHeader(cpr::Header{ {"Accept", "text/*"} });
-    session.SetConnectTimeout(cpr::ConnectTimeout{ 2500 });
-    session.SetTimeout(cpr::Timeout{ 5500 });
-
-    while (!stop_requested) {        
-        std::string url("");        
-        std::unique_lock<std::mutex> lck(mtx);
-        auto limited1 = memory_storage.get_all<UrlData>(where(c(&UrlData::last_crawled) == ""), limit(1));
-        if (limited1.size() == 1) {
-            url = limited1[0].url;
-            memory_storage.update_all(set(c(&UrlData::last_crawled) = get_current_time(), c(&UrlData::status_code) = 200), where(c(&UrlData::url) == url));
+    // Deterministic page: a link to the next page (every page is reachable), random links, images and filler text
+    void get_page(const size_t id, std::string& html) const {
+        uint64_t state = id * 0x2545f4914f6cdd1dULL + 7;
+        auto append_words = [&](size_t count) {
+            for (size_t i = 0; i < count; ++i) {
+                if (i > 0) html += ' ';
+                html += m_words[next_random(state) % m_words.size()];
+            }
+        };
+        html = "<!DOCTYPE html><html><head><meta charset=\"utf-8\"><title>Synthetic page " + std::to_string(id) + "</title></head><body><h1>";
+        append_words(6);
+        html += "</h1><ul>";
+        for (size_t i = 0; i < m_options.fanout; ++i) {
+            const size_t target = i == 0 ? (id + 1) % m_options.pages : next_random(state) % m_options.pages;
+            html += "<li><a href=\"" + get_page_url(target) + "\">";
+            append_words(3);
+            html += "</a></li>";
         }
-        lck.unlock();
-        if (url.empty()) {
-            std::this_thread::sleep_for(std::chrono::seconds(3));
-            continue;
+        html += "</ul>";
+        for (size_t j = 0; j < m_options.images; ++j) {
+            html += "<figure><img src=\"" + get_image_url(id, id * m_options.images + j) + "\" alt=\"";
+            append_words(4);
+            html += "\"><figcaption>";
+            append_words(10);
+            html += "</figcaption></figure>";
         }
-                        
-        session.SetUrl(cpr::Url{ url });        
-        GumboOutput* doc = nullptr;
-        try {
-            auto r = session.Get();
-            if (r.status_code == 200) {
-                if (r.text.size() > max_html_page_size) r.text.resize(max_html_page_size);                
-                if ((doc = gumbo_parse(r.text.c_str())) != nullptr) {
-                    // Extract all links (internal and external) from the current page
-                    if (!no_new_urls && !no_new_urls_auto) extract_links(doc->root, url);
-                    // Extract all image links from the current page
-                    std::string page_title = get_page_title(doc->root);
-                    if (page_title.empty()) page_title = get_first_h1_text(doc->root);
-                    extract_image_links(doc->root, url, page_title);
-                }
+        while (html.size() < m_options.page_size) {
+            html += "<p>";
+            append_words(20 + next_random(state) % 40);
+            html += "</p>";
+        }
+        html += "</body></html>";
+    }
+    // Same answer to each request of a given path, errors included
+    bool is_error(const std::string& path) const {
+        if (m_options.error_rate <= 0.0) return false;
+        uint64_t state = std::hash<std::string>()(path);
+        return next_random(state) % 1000000 < static_cast<uint64_t>(m_options.error_rate * 1000000);
+    }
+    void respond(const std::string& head, std::string& response, bool& keep_alive) {
+        std::string method, path;
+        std::istringstream request_line(head.substr(0, head.find("\r\n")));
+        request_line >> method >> path;
+        keep_alive = boost::algorithm::ifind_first(head, "connection: close").empty();
+        std::string body, content_type = "text/html; charset=utf-8", status = "200 OK";
+        size_t id = 0;
+        const bool is_page = path.compare(0, 6, "/page/") == 0, is_image = path.compare(0, 5, "/img/") == 0;
+        if ((is_page || is_image) && sscanf(path.c_str() + (is_page ? 6 : 5), "%zu", &id) == 1 && (is_page ? id < m_options.pages : id < m_options.pages * m_options.images) && !is_error(path)) {
+            if (is_page) {
+                get_page(id, body);
+                m_pages_served++;
             }
             else {
-                lck.lock();
-                memory_storage.update_all(set(c(&UrlData::status_code) = r.status_code), where(c(&UrlData::url) == url));
-                lck.unlock();
+                const auto& image = m_images[id % m_images.size()];
+                body = image.second;
+                content_type = image.first == "png" ? "image/png" : "image/jpeg";
+                m_images_served++;
             }
         }
-        catch(...) {
-            if (verbose) std::cout << "Critical issue occured during a web page analysis: " << url << std::endl;
-            lck.lock();
-            memory_storage.update_all(set(c(&UrlData::status_code) = 503), where(c(&UrlData::url) == url));
-            lck.unlock();
-        }
-        if (doc != nullptr) gumbo_destroy_output(&kGumboDefaultOptions, doc);
-        total_pages++;        
-    }
-}
-
-// Copy image files from source to destination recursively
-static size_t nb_imgs = 0;
-const size_t nb_imgs_display = 5000;
-void copy_and_delete_images(const boost::filesystem::path& src, const boost::filesystem::path& dst) {    
-    if (!is_directory(src)) return;
-    // Create destination folder if it does not exist
-    if (!exists(dst)) create_directory(dst);
-    // Iterate over files in source directory
-    for (boost::filesystem::recursive_directory_iterator it(src), end; it != end && !stop_requested; ++it) {
-        if (boost::filesystem::is_regular_file(*it) && it->path().extension() == ".jpg") {
-            auto p = it->path();
-            std::string md5_hash = calculate_md5_from_path(p);
-            // Split the MD5 hash into two parts: the first 2 characters and the remaining characters
-            std::string top_folder_name = md5_hash.substr(0, 1);
-            std::string sub_folder_name = md5_hash.substr(1, 1);
-            std::string file_name = md5_hash.substr(2);
-            std::string folder_pathname = dst.string();
-            folder_pathname += "/" + top_folder_name;
-            if (!boost::filesystem::exists(folder_pathname)) boost::filesystem::create_directory(folder_pathname);
-            folder_pathname += "/" + sub_folder_name;
-            if (!boost::filesystem::exists(folder_pathname)) boost::filesystem::create_directory(folder_pathname);
-            folder_pathname += "/" + file_name + ".jpg";
-            copy_file(p, boost::filesystem::path(folder_pathname), boost::filesystem::copy_option::overwrite_if_exists);
-            boost::filesystem::remove(p);
-            if ((nb_imgs++ % nb_imgs_display) == 0) std::cout << ".";
+        else {
+            status = (is_page || is_image) && id % 2 == 0 ? "500 Internal Server Error" : "404 Not Found";
+            body = "<html><body>" + status + "</body></html>";
+            m_errors_served++;
         }
+        response = "HTTP/1.1 " + status + "\r\nContent-Type: " + content_type + "\r\nContent-Length: " + std::to_string(body.size()) + "\r\n";
+        if (!keep_alive) response += "Connection: close\r\n";
+        response += "\r\n";
+        if (method != "HEAD") response += body;
     }
-}
-
-// Move image files and metadata
-void move(const boost::filesystem::path& src_root, const boost::filesystem::path& dst_root) {
-    const boost::filesystem::path img_cache_dir = src_root / "img_cache";
-    const boost::filesystem::path db_dest_path = dst_root / "queues.db";
 
-    // Copy image files recursively
-    std::cout << "Moving images ";
-    copy_and_delete_images(img_cache_dir, dst_root / img_cache_dir.filename());
-    std::cout << " done" << std::endl << std::endl;
+    Options m_options;
+    std::vector<std::string> m_words;
+    std::vector<std::pair<std::string, std::string>> m_images; // Type and bytes
+    boost::asio::io_context m_io;
+    std::vector<std::unique_ptr<boost::asio::ip::tcp::acceptor>> m_acceptors;
+    std::vector<std::thread> m_threads;
+    unsigned short m_port = 0;
+    std::chrono::steady_clock::time_point m_start_time;
+    std::atomic<std::chrono::steady_clock::rep> m_last_activity = 0;
+    std::atomic<size_t> m_in_flight = 0, m_pages_served = 0, m_images_served = 0, m_errors_served = 0, m_bytes_served = 0;
+};
+SyntheticSite synthetic_site;
 
-    // Open the detination sqlite database and insert metadata. Iterate over all images in the database
-    // For each image, read metadata and insert into destination database
-    std::cout << "Updating metadata... ";
-    auto dst_storage = make_storage(db_dest_path.string(),
-        make_table("images",
-            make_column("url", &ImageData::url, unique()),
-            make_column("alt", &ImageData::alt),
-            make_column("source", &ImageData::source_page),
-            make_column("surrounding", &ImageData::surrounding_text),
-            make_column("file_size", &ImageData::file_size),
-            make_column("width", &ImageData::width),
-            make_column("height", &ImageData::height),
-            make_column("mime", &ImageData::mime),
-            make_column("last_seen", &ImageData::last_seen))
-    );
-    dst_storage.sync_schema();
-    dst_storage.transaction([&]() mutable {                
-        auto images_data = storage.get_all<ImageData>();
-        for (auto& img : images_data) {
-            try { dst_storage.insert(img); }
-            catch (...) {}
-        }
-        images_data.clear();
-        return true;
-        });
-    std::cout << " done" << std::endl << std::endl;
+// The crawl of the synthetic site is over once nothing is left to fetch or to process and the site has been idle for a while
+bool bench_crawl_finished() {
+    const std::chrono::milliseconds idle_window(2000 + 2 * synthetic_site.options().latency_ms);
+    return frontier.size() == 0 && parse_queue.size() == 0 && image_queue.size() == 0 && transcode_queue.size() == 0 &&
+        total_pages >= synthetic_site.pages_served() && synthetic_site.idle_for(idle_window);
 }
 
-// Function to synchronize image cache on disk and info into a database
-void sync_image_cache(void) {
-    // Create indexed STL structure for image files
-    const boost::filesystem::path img_cache_dir = boost::filesystem::current_path() / "img_cache";
-    std::cout << "Reading the image cache ";
-    std::map<std::string, boost::filesystem::path> image_files;
-    for (boost::filesystem::recursive_directory_iterator it(img_cache_dir), end; it != end && !stop_requested; ++it) {
-        if (boost::filesystem::is_regular_file(*it) && it->path().extension() == ".jpg") {
-            auto p = it->path();
-            image_files[calculate_md5_from_path(p)] = p;
-            if ((nb_imgs++ % nb_imgs_display) == 0) std::cout << ".";
-        }
-    }
-    std::cout << std::endl << " done" << std::endl;
-
-    // Create indexed STL structure for image urls in database
-    std::cout << "Reading the database ";
-    nb_imgs = 0;
-    std::map<std::string, std::string> image_urls;
-    auto img_urls = storage.select(&ImageData::url);
-    for (auto &src_url : img_urls) {
-        size_t md5_as_int = boost::hash<std::string>{}(src_url); // Calculate the MD5 hash of the string
-        std::stringstream ss;
-        ss << std::hex << std::setw(16) << std::setfill('0') << md5_as_int;
-        image_urls[ss.str()] = src_url;
-        if ((nb_imgs++ % nb_imgs_display) == 0) std::cout << ".";
-        if (stop_requested) break;
-    }
-    std::cout << std::endl << " done" << std::endl;
-    img_urls.clear();
-
-    // Remove files on disk for which the hash is not present in the database
-    std::cout << "Updating the image cache ";
-    nb_imgs = 0;
-    size_t removed_imgs = 0;
-    for (auto& it : image_files) {
-        if (image_urls.find(it.first) == image_urls.end()) {
-            boost::filesystem::remove(it.second);
-            removed_imgs++;
-        }
-        if ((nb_imgs++ % nb_imgs_display) == 0) std::cout << ".";
-        if (stop_requested) break;
+// Results of the crawl benchmark, as one JSON line on the console and appended to a file to track them over time
+void report_bench_crawl(const std::string& filename, const size_t num_threads, const double cpu_seconds, const bool complete) {
+    const SyntheticSite::Options& site = synthetic_site.options();
+    const double seconds = synthetic_site.active_seconds();
+    const LatencyHistogram::Snapshot lock_wait = db_wait_latency.snapshot();
+    std::stringstream line;
+    line << std::fixed << std::setprecision(3) << "{\"time\":\"" << get_current_time() << "\",\"complete\":" << (complete ? "true" : "false");
+    line << ",\"site\":{\"pages\":" << site.pages << ",\"fanout\":" << site.fanout << ",\"page_size\":" << site.page_size << ",\"images\":" << site.images;
+    line << ",\"image_size\":" << site.image_size << ",\"image_format\":\"" << site.image_format << "\",\"latency_ms\":" << site.latency_ms << ",\"error_rate\":" << site.error_rate << ",\"hosts\":" << site.hosts << "}";
+    line << ",\"threads\":" << num_threads << ",\"extractor\":\"" << (stream_extractor ? "stream" : "gumbo") << "\",\"elapsed_s\":" << seconds;
+    line << ",\"pages\":" << total_pages << ",\"pages_per_sec\":" << total_pages / seconds;
+    line << ",\"images\":" << synthetic_site.images_served() << ",\"images_per_sec\":" << synthetic_site.images_served() / seconds << ",\"stored_images\":" << visited_images;
+    line << ",\"duplicate_images\":" << total_duplicate_images << ",\"pruned_pages\":" << total_pruned_pages << ",\"errors\":" << synthetic_site.errors_served();
+    line << ",\"mb_served\":" << synthetic_site.bytes_served() / (1024.0 * 1024.0) << ",\"mb_wire\":" << (page_fetcher.wire_bytes() + image_fetcher.wire_bytes()) / (1024.0 * 1024.0);
+    line << ",\"mb_decoded\":" << (page_fetcher.decoded_bytes() + image_fetcher.decoded_bytes()) / (1024.0 * 1024.0) << ",\"cpu_s\":" << cpu_seconds;
+    line << ",\"cpu_ms_per_page\":" << (total_pages == 0 ? 0.0 : cpu_seconds * 1000.0 / total_pages) << ",\"peak_rss_mb\":" << get_peak_memory_mb();
+    // The waits of zero microsecond are the lock acquisitions without contention
+    const uint64_t contended = lock_wait.count - lock_wait.buckets[0];
+    line << ",\"lock_wait\":{\"acquisitions\":" << lock_wait.count << ",\"contended_pct\":" << (lock_wait.count == 0 ? 0.0 : 100.0 * contended / lock_wait.count);
+    line << ",\"total_s\":" << lock_wait.sum / 1e6 << ",\"p99_ms\":" << lock_wait.percentile(0.99) / 1000.0 << "}";
+    line << ",\"stages\":{";
+    const auto stages = get_stage_latencies();
+    for (size_t i = 0; i < stages.size(); ++i) {
+        const LatencyHistogram::Snapshot snap = stages[i].second->snapshot();
+        line << (i == 0 ? "" : ",") << "\"" << stages[i].first << "\":{\"count\":" << snap.count << ",\"p50_ms\":" << snap.percentile(0.5) / 1000.0 << ",\"p99_ms\":" << snap.percentile(0.99) / 1000.0 << "}";
     }
-    std::cout << " done - " << removed_imgs << " image(s) removed)" << std::endl << std::endl;
+    line << "}}";
+    std::cout << std::endl << line.str() << std::endl;
+    if (filename.empty()) return;
+    std::ofstream file(filename, std::ios::out | std::ios::app);
+    if (file.is_open()) file << line.str() << std::endl;
+    else std::cerr << "Unable to write the benchmark results to " << filename << std::endl;
 }
 
 int main(int argc, char* argv[]) {
@@ -782,13 +4631,44 @@ int main(int argc, char* argv[]) {
     desc.add_options()
         ("help,h", "Show help message")
         ("verbose,v", "Set the verbose mode")
-        ("auto-flush,f", "Activate the metadata autoflush")
+        ("auto-flush,f", "Write the metadata changes to disk every 10 seconds instead of every 5 minutes")
         ("no-new-urls,u", "Don't add new urls to the queue")
+        ("recrawl", "Revisit the crawled pages, at an interval adapted to how often each one changes")
         ("refresh-time,r", po::value<int>()->default_value(20), "Set the refresh stats time")
-        ("threads,t", po::value<int>()->default_value(std::thread::hardware_concurrency()), "Set the total threads number")
+        ("metrics-port", po::value<int>(), "Serve the metrics in the Prometheus text format on this local port")
+        ("metrics-log", po::value<std::string>(), "Append the metrics of each refresh interval to this file, as JSON lines")
+        ("threads,t", po::value<int>()->default_value(std::thread::hardware_concurrency()), "Set the total parsing threads number")
+        ("fetch-threads", po::value<int>()->default_value(2), "Set the total network event loop threads number")
+        ("max-in-flight,i", po::value<int>()->default_value(1000), "Set the maximum number of concurrent page requests")
+        ("image-threads", po::value<int>()->default_value(std::max<int>(1, std::thread::hardware_concurrency() / 2)), "Set the total image processing threads number")
+        ("image-in-flight", po::value<int>()->default_value(200), "Set the maximum number of concurrent image requests")
+        ("image-queue", po::value<int>()->default_value(100000), "Set the maximum number of image URLs waiting to be downloaded")
         ("add-url,a", "Add a new starting URL")
         ("move-cache,m", po::value<std::string>(), "Move the image cache to another drive")
-        ("sync-cache,s", "Synchronize the image cache with the database");
+        ("sync-cache,s", "Synchronize the image cache with the database")
+        ("packed-store", "Append the new images to large segment files instead of storing each one in its own file")
+        ("compact-store", "Reclaim the space of the packed store records no image points at")
+        ("warc", "Archive the fetched pages and images as WARC files")
+        ("replay", po::value<std::string>(), "Extract again the pages of a WARC file, or of the WARC files of a folder, without any download")
+        ("bench-resize", po::value<std::string>(), "Benchmark the image resize paths on the JPEG files of a folder")
+        ("extractor", po::value<std::string>()->default_value("gumbo"), "Set the page extraction engine: gumbo or stream")
+        ("no-parse-arena", "Parse the pages with the default Gumbo allocator instead of the per-thread arenas")
+        ("no-page-dedup", "Publish the links and images of the pages that are near duplicates of a recently parsed one")
+        ("diff-extract", po::value<std::string>(), "Compare the page extraction engines on the HTML files of a folder")
+        ("bench-parse", po::value<std::string>(), "Benchmark the page parsing on the HTML files of a folder")
+        ("bench-urls", "Check and benchmark the URL resolver")
+        ("bench-text", po::value<std::string>()->implicit_value(""), "Benchmark the text normalization on the lines of a file (default: the texts of the database)")
+        ("bench-crawl", po::value<std::string>()->implicit_value(""), "Benchmark the whole crawl against a local synthetic site, the JSON results being appended to the given file")
+        ("bench-duration", po::value<int>()->default_value(600), "Set the maximum duration of the crawl benchmark, in seconds")
+        ("site-pages", po::value<int>()->default_value(2000), "Set the number of pages of the synthetic site")
+        ("site-fanout", po::value<int>()->default_value(10), "Set the number of links of each synthetic page")
+        ("site-page-size", po::value<int>()->default_value(20000), "Set the size of each synthetic page, in bytes")
+        ("site-images", po::value<int>()->default_value(4), "Set the number of images of each synthetic page")
+        ("site-image-size", po::value<int>()->default_value(480), "Set the width of the synthetic images, in pixels")
+        ("site-image-format", po::value<std::string>()->default_value("jpg"), "Set the format of the synthetic images: jpg, png or mixed")
+        ("site-latency", po::value<int>()->default_value(0), "Set the delay added to each response of the synthetic site, in milliseconds")
+        ("site-error-rate", po::value<double>()->default_value(0.0), "Set the fraction of the synthetic URLs answered with an error")
+        ("site-hosts", po::value<int>()->default_value(8), "Set the number of loopback hosts serving the synthetic site");
     po::variables_map vm;
     try {
         po::store(po::parse_command_line(argc, argv, desc), vm);
@@ -797,6 +4677,10 @@ int main(int argc, char* argv[]) {
             std::cout << desc << std::endl;
             return 0;
         }
+        const std::string extractor = vm["extractor"].as<std::string>();
+        if (extractor != "gumbo" && extractor != "stream") throw po::validation_error(po::validation_error::invalid_option_value, "extractor", extractor);
+        // The maintenance commands read all the columns of the current schema, migrate an older database first
+        if (vm.count("move-cache") || vm.count("sync-cache") || vm.count("compact-store") || (vm.count("bench-text") && vm["bench-text"].as<std::string>().empty())) storage.sync_schema();
         if (vm.count("move-cache")) {
             std::string sync_dst_root = vm["move-cache"].as<std::string>();
             move(boost::filesystem::current_path(), boost::filesystem::path(sync_dst_root));
@@ -806,120 +4690,265 @@ int main(int argc, char* argv[]) {
             sync_image_cache();
             return 0;
         }
+        if (vm.count("compact-store")) {
+            compact_store();
+            return 0;
+        }
+        use_parse_arena = vm.count("no-parse-arena") ? false : true;
+        page_dedup = vm.count("no-page-dedup") ? false : true;
+        if (vm.count("bench-parse")) {
+            bench_parse(boost::filesystem::path(vm["bench-parse"].as<std::string>()), std::min<std::size_t>(max_threads, vm["threads"].as<int>()));
+            return 0;
+        }
+        if (vm.count("diff-extract")) {
+            diff_extract(boost::filesystem::path(vm["diff-extract"].as<std::string>()));
+            return 0;
+        }
+        if (vm.count("bench-urls")) {
+            bench_urls();
+            return 0;
+        }
+        if (vm.count("bench-text")) {
+            bench_text(vm["bench-text"].as<std::string>());
+            return 0;
+        }
+        if (vm.count("bench-resize")) {
+            bench_resize(boost::filesystem::path(vm["bench-resize"].as<std::string>()));
+            return 0;
+        }
+        const bool bench_crawl = vm.count("bench-crawl") ? true : false;
+        std::string bench_output;
+        if (bench_crawl) {
+            // Crawl the synthetic site from an empty database, in a folder of its own
+            bench_output = vm["bench-crawl"].as<std::string>();
+            if (!bench_output.empty()) bench_output = boost::filesystem::absolute(bench_output).string();
+            const boost::filesystem::path bench_folder = boost::filesystem::temp_directory_path() / "ffspider_bench_crawl";
+            boost::system::error_code ec;
+            boost::filesystem::remove_all(bench_folder, ec);
+            boost::filesystem::create_directories(bench_folder);
+            boost::filesystem::current_path(bench_folder);
+            SyntheticSite::Options site;
+            site.pages = std::max<int>(1, vm["site-pages"].as<int>());
+            site.fanout = std::max<int>(1, vm["site-fanout"].as<int>());
+            site.page_size = std::max<int>(0, vm["site-page-size"].as<int>());
+            site.images = std::max<int>(0, vm["site-images"].as<int>());
+            site.image_size = std::max<int>(16, vm["site-image-size"].as<int>());
+            site.image_format = vm["site-image-format"].as<std::string>();
+            site.latency_ms = std::max<int>(0, vm["site-latency"].as<int>());
+            site.error_rate = vm["site-error-rate"].as<double>();
+            site.hosts = std::max<int>(1, vm["site-hosts"].as<int>());
+            std::cout << "Generating the synthetic site in " << bench_folder.string() << "... ";
+            if (!synthetic_site.start(site)) return 1;
+            std::cout << "done" << std::endl;
+        }
         
         // Initialize the storage
         storage.sync_schema();
+        storage.open_forever();
+        storage.pragma.journal_mode(journal_mode::WAL);
+        storage.pragma.synchronous(1); // NORMAL, safe with WAL
         memory_storage.sync_schema();
 
         // Read parameters
         verbose = vm.count("verbose") ? true : false;
         bool auto_flush = vm.count("auto-flush") ? true : false;
         no_new_urls = vm.count("no-new-urls") ? true : false;
+        stream_extractor = (extractor == "stream");
+        use_packed_store = vm.count("packed-store") ? true : false;
+        if (use_packed_store) packed_store.open(boost::filesystem::current_path() / "img_store");
+        replaying = vm.count("replay") ? true : false;
+        if (vm.count("warc") && !replaying && !warc_writer.open(boost::filesystem::current_path() / warc_folder)) std::cerr << "Unable to create the WARC folder" << std::endl;
+        if (vm.count("recrawl")) recrawl_scheduler.enable();
         int refresh_time = vm["refresh-time"].as<int>();
         size_t num_threads = std::min<std::size_t>(max_threads, vm["threads"].as<int>());        
-        std::string start_url = vm.count("add-url") ? vm["add-url"].as<std::string>() : "https://www.starting_url.com/my_dir";
+        size_t num_fetch_threads = std::max<int>(1, vm["fetch-threads"].as<int>());
+        size_t max_in_flight = std::max<int>(1, vm["max-in-flight"].as<int>());
+        size_t num_image_threads = std::min<std::size_t>(max_threads, std::max<int>(1, vm["image-threads"].as<int>()));
+        size_t image_in_flight = std::max<int>(1, vm["image-in-flight"].as<int>());
+        image_queue.set_capacity(std::max<int>(1, vm["image-queue"].as<int>()));
+        std::string start_url = bench_crawl ? synthetic_site.start_url() : (vm.count("add-url") ? vm["add-url"].as<std::string>() : "https://www.starting_url.com/my_dir");
         boost::algorithm::trim(start_url);
         boost::replace_all(start_url, " ", "%20");        
         if (start_url.back() == '/') start_url.pop_back();
         
-        // Copy all URL metadata from the disk-based database to the in-memory database
+        // Load only what the crawl needs from the disk-based database: the fingerprints of all the known URLs and images,
+        // the pending URLs and the images not downloaded yet. All other metadata stays on disk, as the rows of the pending
+        // URLs spilled to the frontier segments
         std::cout << "Loading the metadata from disk... ";
-        std::unique_lock<std::mutex> lck(mtx);
-        auto urls_data = storage.get_all<UrlData>();
-        for (auto& url : urls_data) memory_storage.insert(url);
-        urls_data.clear();
+        frontier.init(num_fetch_threads * 64, num_fetch_threads, max_host_connections);
+        frontier.set_spill(frontier_folder, frontier_hot_capacity);
+        std::vector<UrlData> pending_urls_data;
+        std::vector<ImageData> pending_images_data;
+        const std::time_t now = std::time(nullptr);
+        for (auto& url : storage.iterate<UrlData>()) {
+            seen_urls.insert(url_fingerprint(url.url));
+            if (url.last_crawled == nullptr || url.last_crawled->empty()) {
+                if (!frontier.push(url.url)) pending_urls_data.push_back(std::move(url));
+            }
+            else if (url.status_code == 200) {
+                visited_pages++;
+                if (recrawl_scheduler.enabled()) { // Pages crawled before the validators were stored are revisited right away
+                    PageValidators validators{ std::move(url.etag), std::move(url.last_modified), std::move(url.content_hash), url.revisit_interval == 0 ? initial_revisit_interval : url.revisit_interval };
+                    recrawl_scheduler.add(std::move(url.url), std::move(validators), url.next_crawl.empty() ? now : parse_time(url.next_crawl));
+                }
+            }
+        }
+        for (auto& img : storage.iterate<ImageData>()) {
+            seen_images.insert(url_fingerprint(img.url));
+            // Perceptual hashes of the last stored images for the near duplicates, the exact ones are looked up on disk
+            Sha256Digest key;
+            uint64_t hash = 0;
+            if (img.file_size > 0 && from_hex(img.content_hash, key.data(), key.size()) && from_hex(img.phash, reinterpret_cast<uint8_t*>(&hash), sizeof(hash))) perceptual_index.insert(hash, key);
+            if (img.file_size > 0) cached_images++;
+            if (img.mime == nullptr || img.mime->empty()) pending_images_data.push_back(std::move(img));
+            else if (*img.mime != unsupported_image_mime) visited_images++;
+        }
+        std::unique_lock<DbMutex> lck(mtx);
+        memory_storage.transaction([&]() mutable {
+            for (size_t i = 0; i < pending_urls_data.size(); i += 100) memory_storage.insert_range(pending_urls_data.begin() + i, pending_urls_data.begin() + std::min<size_t>(i + 100, pending_urls_data.size()));
+            for (size_t i = 0; i < pending_images_data.size(); i += 100) memory_storage.insert_range(pending_images_data.begin() + i, pending_images_data.begin() + std::min<size_t>(i + 100, pending_images_data.size()));
+            return true;
+            });
         std::string last_crawled(""), last_seen = get_current_time();
-        UrlData data{ start_url, std::make_unique<std::string>(last_crawled), last_seen };
-        try { memory_storage.insert(data); }
-        catch(...) {}
-        // Copy all image metadata from the disk-based database to the in-memory database
-        auto images_data = storage.get_all<ImageData>();
-        for (auto& img : images_data) memory_storage.insert(img);
-        images_data.clear();
+        if (seen_urls.insert(url_fingerprint(start_url))) {
+            UrlData data{ start_url, std::make_unique<std::string>(last_crawled), last_seen };
+            memory_storage.insert(data);
+            persister.mark_url(start_url);
+            if (frontier.push(start_url)) persister.spill_urls({ start_url });
+        }
+        pending_urls_data.clear();
+        frontier.set_refill_handler(reload_spilled_urls);
+        // Images found during a previous session but not downloaded yet
+        std::vector<std::string> pending_images;
+        for (auto& img : pending_images_data) pending_images.push_back(img.url);
+        pending_images_data.clear();
         lck.unlock();
         std::cout << "done" << std::endl;
+        if (recrawl_scheduler.enabled()) std::cout << recrawl_scheduler.size() << " crawled pages scheduled for a revisit" << std::endl;
        
-        std::cout << "Starting the spider with " << num_threads << " threads... ";
+        std::cout << "Starting the spider with " << num_threads << " threads and up to " << max_in_flight << " requests in flight... ";
+        curl_global_init(CURL_GLOBAL_ALL);
         std::thread spider_threads[max_threads];
         for (size_t i = 0; i < num_threads; ++i) spider_threads[i] = std::thread(spider);
+        std::thread image_threads[max_threads];
+        for (size_t i = 0; i < num_image_threads; ++i) image_threads[i] = std::thread(image_worker);
+        std::atomic<bool> replay_done = false;
+        std::thread replay_thread, drain_thread;
+        if (replaying) {
+            // The archive replaces the network, the images found meanwhile are left pending for a later crawl
+            std::unordered_set<uint64_t> replay_images;
+            for (auto& image_url : pending_images) replay_images.insert(url_fingerprint(image_url));
+            pending_images.clear();
+            const boost::filesystem::path replay_path(vm["replay"].as<std::string>());
+            replay_thread = std::thread([&replay_done, replay_path, replay_images = std::move(replay_images)]() mutable {
+                replay_warc(replay_path, std::move(replay_images));
+                replay_done = true;
+                });
+            drain_thread = std::thread([]() {
+                std::string image_url;
+                while (image_queue.pop(image_url)) {}
+                });
+        }
+        else {
+            page_fetcher.set_validators([](const std::string& url, std::string& etag, std::string& last_modified) { return recrawl_scheduler.request_validators(url, etag, last_modified); });
+            page_fetcher.start(num_fetch_threads, max_in_flight, next_page, page_fetched);
+            image_fetcher.set_check(check_image);
+            image_fetcher.start(1, image_in_flight, next_image, image_fetched);
+        }
+        std::thread requeue_thread([&pending_images]() {
+            for (auto& image_url : pending_images) if (!image_queue.push(std::move(image_url))) break;
+            pending_images.clear();
+            });
+        std::thread crawl_log_thread(crawl_log_writer);
+        std::thread persister_thread(persister_writer, auto_flush ? persist_time : auto_flush_time);
+        if (vm.count("metrics-port")) metrics_server.start(static_cast<unsigned short>(vm["metrics-port"].as<int>()));
+        MetricsLog metrics_log;
+        if (vm.count("metrics-log") && !metrics_log.open(vm["metrics-log"].as<std::string>())) std::cerr << "Unable to open the metrics log" << std::endl;
         std::cout << "done" << std::endl;
 
-        ElapsedTime stats_timer, flush_timer;
+        ElapsedTime stats_timer, flush_timer, bench_timer;
+        double bench_cpu_seconds = get_cpu_seconds();
+        bool bench_complete = false;
         if (!verbose) {
-            std::cout << std::endl << "| Crawler pages | Crawled images | Pending pages | Visited pages | Visited images | Cached images |" << std::endl;
-            std::cout << "|---------------|----------------|---------------|---------------|----------------|---------------|" << std::endl;
+            std::cout << std::endl << "| Crawler pages | Crawled images | Pending pages | Visited pages | Visited images | Cached images | Dup. images | Pruned pages | Pages/sec | Reused conn. | Handshake ms |   Wire MB | Decoded MB | Peak RSS MB |" << std::endl;
+            std::cout << "|---------------|----------------|---------------|---------------|----------------|---------------|-------------|--------------|-----------|--------------|--------------|-----------|------------|-------------|" << std::endl;
         }
+        size_t last_total_pages = 0;
         while (!stop_requested) {            
+            if (bench_crawl && ((bench_complete = bench_crawl_finished()) || bench_timer.getSeconds() >= vm["bench-duration"].as<int>())) {
+                bench_cpu_seconds = get_cpu_seconds() - bench_cpu_seconds;
+                stop_requested = true;
+                break;
+            }
+            if (replaying && replay_done && parse_queue.size() == 0 && transcode_queue.size() == 0) {
+                stop_requested = true;
+                break;
+            }
+            // Hand the pages due for a revisit over to the frontier, without flooding it
+            if (recrawl_scheduler.enabled() && frontier.size() < urls_queue_threshold_min) recrawl_scheduler.schedule_due(std::time(nullptr), urls_queue_threshold_min);
             if (stats_timer.getSeconds() < refresh_time) {
                 std::this_thread::sleep_for(std::chrono::seconds(3));
                 continue;
             }                        
 
-            lck.lock();            
-            size_t num_pending_web_pages = memory_storage.count<UrlData>(where(c(&UrlData::last_crawled) == ""));
-            size_t num_visited_web_pages = memory_storage.count<UrlData>(where((c(&UrlData::last_crawled) != "") and c(&UrlData::status_code) == 200));
-            size_t num_visited_images = memory_storage.count<ImageData>(where(c(&ImageData::mime) != unsupported_image_mime));
-            size_t num_cached_images = memory_storage.count<ImageData>(where(c(&ImageData::file_size) > 0));
+            // Counters maintained by the threads, no table scan
+            size_t num_pending_web_pages = frontier.size();
+            size_t num_visited_web_pages = visited_pages, num_visited_images = visited_images, num_cached_images = cached_images;
             if (flush_timer.getSeconds() >= auto_flush_time) {
-                memory_storage.transaction([&]() mutable {
-                    memory_storage.remove_all<UrlData>(where((c(&UrlData::last_crawled) != "") and (c(&UrlData::status_code) != 200)));
-                    memory_storage.remove_all<ImageData>(where(c(&ImageData::mime) == unsupported_image_mime));
-                    return true;
-                    });
-                if (auto_flush) {
-                    storage.transaction([&]() mutable {
-                        // Remove all entries in the tables
-                        storage.remove_all<UrlData>();
-                        storage.remove_all<ImageData>();
-                        // Insert new metadata
-                        urls_data = memory_storage.get_all<UrlData>();
-                        for (auto& url : urls_data) storage.insert(url);
-                        urls_data.clear();
-                        images_data = memory_storage.get_all<ImageData>();
-                        for (auto& img : images_data) storage.insert(img);
-                        images_data.clear();
-                        return true;
-                        });
-                }
+                purge_failed_rows();
                 flush_timer.reset();
             }
-            lck.unlock();
             
             // Display stats
+            const size_t current_total_pages = total_pages;
+            const double pages_per_sec = (current_total_pages - last_total_pages) * 1000.0 / std::max<long long>(1, stats_timer.getMilliseconds());
+            const size_t num_connections = page_fetcher.new_connections() + page_fetcher.reused_connections();
+            const double reused_connections = num_connections == 0 ? 0.0 : 100.0 * page_fetcher.reused_connections() / num_connections;
+            last_total_pages = current_total_pages;
+            std::stringstream stats;
+            stats << "| " << std::setw(13) << current_total_pages << " | " << std::setw(14) << total_images << " | " << std::setw(13) << num_pending_web_pages << " | " << std::setw(13) << num_visited_web_pages << " | " << std::setw(14) << num_visited_images << " | " << std::setw(13) << num_cached_images << " | " << std::setw(11) << total_duplicate_images << " | " << std::setw(12) << total_pruned_pages << " | ";
+            const double wire_mb = (page_fetcher.wire_bytes() + image_fetcher.wire_bytes()) / (1024.0 * 1024.0), decoded_mb = (page_fetcher.decoded_bytes() + image_fetcher.decoded_bytes()) / (1024.0 * 1024.0);
+            stats << std::fixed << std::setprecision(1) << std::setw(9) << pages_per_sec << " | " << std::setw(11) << reused_connections << "% | " << std::setw(12) << page_fetcher.handshake_ms() << " | ";
+            stats << std::setw(9) << wire_mb << " | " << std::setw(10) << decoded_mb << " | " << std::setw(11) << get_peak_memory_mb() << " |";
             if (verbose) {
-                std::cout << std::endl << "| Crawler pages | Crawled images | Pending pages | Visited pages | Visited images | Cached images |" << std::endl;
-                std::cout << "|---------------|----------------|---------------|---------------|----------------|---------------|" << std::endl;
-                std::cout << "| " << std::setw(13) << total_pages << " | " << std::setw(14) << total_images << " | " << std::setw(13) << num_pending_web_pages << " | " << std::setw(13) << num_visited_web_pages << " | " << std::setw(14) << num_visited_images << " | " << std::setw(13) << num_cached_images << " |" << std::endl;
+                std::cout << std::endl << "| Crawler pages | Crawled images | Pending pages | Visited pages | Visited images | Cached images | Dup. images | Pruned pages | Pages/sec | Reused conn. | Handshake ms |   Wire MB | Decoded MB | Peak RSS MB |" << std::endl;
+                std::cout << "|---------------|----------------|---------------|---------------|----------------|---------------|-------------|--------------|-----------|--------------|--------------|-----------|------------|-------------|" << std::endl;
+                std::cout << stats.str() << std::endl;
             }
             else if(!stop_requested) {
-                std::cout << "| " << std::setw(13) << total_pages << " | " << std::setw(14) << total_images << " | " << std::setw(13) << num_pending_web_pages << " | " << std::setw(13) << num_visited_web_pages << " | " << std::setw(14) << num_visited_images << " | " << std::setw(13) << num_cached_images << " |\r";
+                std::cout << stats.str() << "\r";
             }
+            metrics_log.write(stats_timer.getMilliseconds() / 1000.0);
 
-            if (!no_new_urls_auto && num_pending_web_pages >= urls_queue_threshold_max) no_new_urls_auto = true;
-            if (no_new_urls_auto && num_pending_web_pages < urls_queue_threshold_min) no_new_urls_auto = false;            
             stats_timer.reset();
         }
+        parse_queue.close();
+        image_queue.close();
+        transcode_queue.close();
+        page_fetcher.join();
+        image_fetcher.join();
         for (int i = 0; i < num_threads; ++i) spider_threads[i].join();
+        for (int i = 0; i < num_image_threads; ++i) image_threads[i].join();
+        requeue_thread.join();
+        if (replay_thread.joinable()) replay_thread.join();
+        if (drain_thread.joinable()) drain_thread.join();
+        warc_writer.close();
+        if (vm.count("warc") && !replaying) std::cout << std::endl << "Archived " << warc_writer.written() << " responses into " << warc_writer.segments() << " WARC files" << std::endl;
+        crawl_log_thread.join();
+        crawl_log.flush();
+        metrics_server.stop();
+        if (persister_thread.joinable()) persister_thread.join();
         
-        // Copy all URL metadata from the in-memory database to the disk-based database
+        // Write all the remaining changes from the in-memory database to the disk-based database
         std::cout << std::endl << std::endl << "Saving the metadata on disk... ";
-        storage.transaction([&]() mutable {
-            // Optimize structures
-            memory_storage.remove_all<UrlData>(where((c(&UrlData::last_crawled) != "") and (c(&UrlData::status_code) != 200)));
-            memory_storage.remove_all<ImageData>(where(c(&ImageData::mime) == unsupported_image_mime));
-            // Remove all entries in the tables
-            storage.remove_all<UrlData>();
-            storage.remove_all<ImageData>();
-            // Insert new metadata
-            urls_data = memory_storage.get_all<UrlData>();
-            for (auto& url : urls_data) storage.insert(url);
-            urls_data.clear();
-            images_data = memory_storage.get_all<ImageData>();
-            for (auto& img : images_data) storage.insert(img);
-            images_data.clear();
-            return true;
-        });
+        purge_failed_rows();
+        persister.flush();
         std::cout << "done" << std::endl;        
+        if (recrawl_scheduler.enabled()) std::cout << "Revisited pages: " << recrawl_scheduler.changed() << " changed, " << recrawl_scheduler.unchanged() << " unchanged" << std::endl;
+        if (bench_crawl) {
+            report_bench_crawl(bench_output, num_threads, bench_cpu_seconds, bench_complete);
+            synthetic_site.stop();
+        }
 
         return 0;
     }